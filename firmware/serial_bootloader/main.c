@@ -6,9 +6,13 @@
  */ 
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "sp_driver.h"
 #include "eeprom.h"
 #include "protocol.h"
@@ -23,19 +27,32 @@
 #endif
 
 
-#define BOOTLOADER_VERSION	1
+#define BOOTLOADER_VERSION	7		// 3+ buffers received data while busy, 4+ answers CMD_READ_CYCLE_STATS, 5+ CMD_ERASE_ON_WRITE, 6+ CMD_READ_PAGES, 7+ CMD_READ_INFO
 
-// USART settings, uses default 2MHz CPU clock
+// USART settings, for the 32MHz CPU clock the bootloader switches to (needs VCC of at least 2.7V)
 #define BL_USART			USARTC1
-#define BL_BSEL				1539		// 19200
-#define BL_BSCALE			-7
+#define	BL_USART_RXC_vect	USARTC1_RXC_vect
+#define	RX_BUFFER_SIZE		256			// uint8_t indexes wrap around it
+#define BL_BSEL				3317		// 19200
+#define BL_BSCALE			-4
 #define BL_CLK2X			USART_CLK2X_bm
+#define	BAUDCTRL(bscale, bsel)	((((bscale) & 0x0F) << 12) | (bsel))	// BAUDCTRLB:BAUDCTRLA
+#define	BAUD_CONFIRM_TIMEOUT	512		// RTC ticks to wait for CMD_NOP at a new baud rate
+#define	BUS_IDLE_TICKS		3			// RTC ticks of silence that end another node's traffic or a bad frame
 // for half duplex RS485
 #define	BL_CTRL_PORT		PORTC
 #define	BL_CTRL_DE_PIN_bm	PIN4_bm
 #define	BL_CTRL_nRE_PIN_bm	PIN5_bm
-#define	BL_CTRL_RX_MODE		_delay_us(1000); BL_CTRL_PORT.OUTCLR = BL_CTRL_DE_PIN_bm | BL_CTRL_nRE_PIN_bm; BL_USART.DATA; BL_USART.DATA;
-#define	BL_CTRL_TX_MODE		_delay_ms(10); BL_CTRL_PORT.OUTSET = BL_CTRL_DE_PIN_bm | BL_CTRL_nRE_PIN_bm; _delay_us(1000);
+//#define	BL_PAGE_DMA					// receive page data with a DMA channel instead of the CPU
+#define	BL_DMA_CH			DMA.CH0
+#define	BL_DMA_TRIGSRC		DMA_CH_TRIGSRC_USARTC1_RXC_gc
+//#define	BL_CYCLE_STATS				// count CPU cycles spent receiving pages, uses TCC0, TCC1 and event channel 0
+#define	BL_TURNAROUND_US	11000		// default time for the host to release the bus, CMD_SET_TURNAROUND changes it
+// a muted node never drives the bus, and keeps receiving while the host streams broadcast commands
+// put_char() clears TXCIF for every byte, so RX mode releases the bus as soon as the last stop bit has been sent
+// the receiver is disabled while transmitting, anything the USART picks up meanwhile is discarded
+#define	BL_CTRL_RX_MODE		do { if (!muted) { while (!(BL_USART.STATUS & USART_TXCIF_bm)); BL_CTRL_PORT.OUTCLR = BL_CTRL_DE_PIN_bm | BL_CTRL_nRE_PIN_bm; rx_discard = false; } } while(0)
+#define	BL_CTRL_TX_MODE		do { if (!muted) { turnaround_delay(); rx_discard = true; BL_CTRL_PORT.OUTSET = BL_CTRL_DE_PIN_bm | BL_CTRL_nRE_PIN_bm; } } while(0)
 
 #define LED_PORT			PORTF
 #define	LED_PIN_bm			PIN5_bm
@@ -46,16 +63,127 @@
 
 typedef void (*AppPtr)(void) __attribute__ ((noreturn));
 
+typedef struct {
+	uint16_t	rate_100;		// baud rate / 100
+	uint16_t	baudctrl;
+} BAUD_t;
+
+// rates the host can select with CMD_SET_BAUD, CLK2X at 32MHz, within 0.1%
+const BAUD_t baud_table[] = {
+	{ 192,		BAUDCTRL(BL_BSCALE, BL_BSEL) },
+	{ 384,		BAUDCTRL(-5, 3301) },
+	{ 576,		BAUDCTRL(-5, 2190) },
+	{ 768,		BAUDCTRL(-6, 3269) },
+	{ 1152,		BAUDCTRL(-6, 2158) },
+	{ 2304,		BAUDCTRL(-7, 2094) },
+	{ 4608,		BAUDCTRL(-7, 983) },
+	{ 9216,		BAUDCTRL(-7, 428) },
+	{ 10000,	BAUDCTRL(0, 3) },
+	{ 20000,	BAUDCTRL(0, 1) },
+};
+#define	BAUD_TABLE_SIZE		(sizeof(baud_table) / sizeof(baud_table[0]))
+
 uint8_t		page_buffer[APP_SECTION_PAGE_SIZE];
+uint8_t		compressed_buffer[APP_SECTION_PAGE_SIZE];	// host only compresses pages that get smaller
+uint32_t	window_naks = 0xFFFFFFFF;		// one bit per sequence number not yet received intact
+bool		muted = false;					// RS485 broadcast, responses are suppressed
+bool		deselected = false;				// another node is selected, its responses are not commands
+uint16_t	turnaround_10us = BL_TURNAROUND_US / 10;
+bool		erase_on_write = false;			// page writes erase the page first, CMD_ERASE_ON_WRITE
+
+// receive ring buffer, filled by the RXC interrupt so nothing is lost while the NVM controller is busy
+volatile uint8_t	rx_buffer[RX_BUFFER_SIZE];
+volatile uint8_t	rx_head = 0;
+volatile uint8_t	rx_tail = 0;
+volatile bool		rx_discard = false;
+
+#ifdef BL_CYCLE_STATS
+typedef struct {
+	uint32_t	bytes;				// page bytes received
+	uint32_t	cycles;				// from the first page byte to the last
+	uint32_t	wait_cycles;		// of which the CPU had nothing to do
+} CYCLE_STATS_t;
+
+CYCLE_STATS_t		cycle_stats;
+volatile uint32_t	isr_cycles = 0;
+uint32_t			wait_start;
+	#define	CYCLES_WAIT_BEGIN	do { wait_start = foreground_cycles(); } while(0)
+	#define	CYCLES_WAIT_END		do { cycle_stats.wait_cycles += foreground_cycles() - wait_start; } while(0)
+#else
+	#define	CYCLES_WAIT_BEGIN	do { } while(0)
+	#define	CYCLES_WAIT_END		do { } while(0)
+#endif
+
+
+/**************************************************************************************************
+* Wait for the host's transceiver to switch to receive before driving the bus
+*/
+void turnaround_delay(void)
+{
+	for (uint16_t i = turnaround_10us; i != 0; i--)
+		_delay_us(10);
+}
 
+#ifdef BL_CYCLE_STATS
+/**************************************************************************************************
+* 32 bit CPU cycle counter, TCC0 overflows clock TCC1 through event channel 0. The 16 bit reads
+* share a TEMP register with the interrupt.
+*/
+uint32_t cycle_count(void)
+{
+	uint16_t high, low;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		do
+		{
+			high = TCC1.CNT;
+			low = TCC0.CNT;
+		} while (TCC1.CNT != high);
+	}
+	return ((uint32_t)high << 16) | low;
+}
 
 /**************************************************************************************************
-* Get a character from the USART
+* Cycles spent outside of the receive interrupt
+*/
+uint32_t foreground_cycles(void)
+{
+	uint32_t cycles;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		cycles = cycle_count() - isr_cycles;
+	return cycles;
+}
+#endif
+
+/**************************************************************************************************
+* USART receive interrupt. When the buffer is full the byte is dropped, as an overrun would.
+*/
+ISR(BL_USART_RXC_vect)
+{
+#ifdef BL_CYCLE_STATS
+	uint32_t start = cycle_count();		// prologue and epilogue are not counted
+#endif
+	uint8_t c = BL_USART.DATA;
+	uint8_t next = rx_head + 1;
+	if (!rx_discard && (next != rx_tail))
+	{
+		rx_buffer[rx_head] = c;
+		rx_head = next;
+	}
+#ifdef BL_CYCLE_STATS
+	isr_cycles += cycle_count() - start;
+#endif
+}
+
+/**************************************************************************************************
+* Get a character from the receive buffer
 */
 inline uint8_t get_char(void)
 {
-	while (!(BL_USART.STATUS & USART_RXCIF_bm));
-	return BL_USART.DATA;
+	while (rx_head == rx_tail);
+	uint8_t c = rx_buffer[rx_tail];
+	rx_tail++;
+	return c;
 }
 
 /**************************************************************************************************
@@ -63,9 +191,222 @@ inline uint8_t get_char(void)
 */
 inline uint8_t get_char_nonblocking(void)
 {
-	if (BL_USART.STATUS & USART_RXCIF_bm)
-		return BL_USART.DATA;
-	return 0;
+	if (rx_head == rx_tail)
+		return 0;
+	return get_char();
+}
+
+/**************************************************************************************************
+* Discard everything received until the bus has been quiet for BUS_IDLE_TICKS
+*/
+void wait_bus_idle(void)
+{
+	uint16_t start = RTC.CNT;
+	while ((uint16_t)(RTC.CNT - start) < BUS_IDLE_TICKS)
+	{
+		asm("wdr");
+		if (rx_head != rx_tail)
+		{
+			rx_tail = rx_head;
+			start = RTC.CNT;
+		}
+	}
+}
+
+/**************************************************************************************************
+* Get the next command. While another node is selected its responses are on the bus too, so only a
+* CMD_SELECT_NODE or a CMD_BROADCAST followed by BROADCAST_MAGIC that follows a quiet period is
+* accepted. CMD_SELECT_NODE checks its own serial.
+*/
+uint8_t get_command(void)
+{
+	static const uint8_t magic[BROADCAST_MAGIC_LENGTH] = BROADCAST_MAGIC;
+
+	if (!deselected)
+		return get_char();
+	
+	for(;;)
+	{
+		wait_bus_idle();
+		uint8_t c = get_char();
+		if (c == CMD_SELECT_NODE)
+			return c;
+		if (c == CMD_BROADCAST)
+		{
+			uint8_t i = 0;
+			while ((i < BROADCAST_MAGIC_LENGTH) && (get_char() == magic[i]))
+				i++;
+			if (i == BROADCAST_MAGIC_LENGTH)
+				return c;
+		}
+	}
+}
+
+#ifdef BL_PAGE_DMA
+/**************************************************************************************************
+* Page bytes in page_buffer so far. The channel reloads TRFCNT when it finishes, so check that it
+* is still enabled first.
+*/
+inline PAGE_INDEX_t dma_received(void)
+{
+	PAGE_INDEX_t received = APP_SECTION_PAGE_SIZE;
+	if (BL_DMA_CH.CTRLA & DMA_CH_ENABLE_bm)
+		received -= BL_DMA_CH.TRFCNT;
+	asm volatile("" ::: "memory");		// page_buffer is written behind the compiler's back
+	return received;
+}
+
+/**************************************************************************************************
+* Receive a page into page_buffer and continue crc (XMODEM) over it. Anything the interrupt has
+* already buffered is copied, the DMA channel moves the rest from the USART while the CPU only
+* updates the CRC.
+*/
+uint16_t get_page(uint16_t crc)
+{
+#ifdef BL_CYCLE_STATS
+	uint32_t start = cycle_count();
+#endif
+	BL_USART.CTRLA = 0;				// the ring buffer stops changing
+	PAGE_INDEX_t buffered = (uint8_t)(rx_head - rx_tail);
+	if (buffered < APP_SECTION_PAGE_SIZE)
+	{
+		uint16_t dest = (uint16_t)&page_buffer[buffered];
+		BL_DMA_CH.TRFCNT = APP_SECTION_PAGE_SIZE - buffered;
+		BL_DMA_CH.DESTADDR0 = dest & 0xFF;
+		BL_DMA_CH.DESTADDR1 = dest >> 8;
+		BL_DMA_CH.CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+	}
+	else
+	{
+		buffered = APP_SECTION_PAGE_SIZE;
+		BL_USART.CTRLA = USART_RXCINTLVL_HI_gc;
+	}
+
+	PAGE_INDEX_t i;
+	for (i = 0; i < buffered; i++)
+	{
+		uint8_t c = rx_buffer[rx_tail++];
+		crc = _crc_xmodem_update(crc, c);
+		page_buffer[i] = c;
+	}
+	while (i < APP_SECTION_PAGE_SIZE)
+	{
+		PAGE_INDEX_t received = dma_received();
+		if (received == i)
+		{
+			CYCLES_WAIT_BEGIN;
+			while ((received = dma_received()) == i);
+			CYCLES_WAIT_END;
+		}
+		for (; i < received; i++)
+			crc = _crc_xmodem_update(crc, page_buffer[i]);
+	}
+
+	BL_DMA_CH.CTRLB = DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm;
+	BL_USART.CTRLA = USART_RXCINTLVL_HI_gc;
+#ifdef BL_CYCLE_STATS
+	cycle_stats.cycles += cycle_count() - start;
+	cycle_stats.bytes += APP_SECTION_PAGE_SIZE;
+#endif
+	return crc;
+}
+#else
+/**************************************************************************************************
+* Receive a page into page_buffer and continue crc (XMODEM) over it
+*/
+uint16_t get_page(uint16_t crc)
+{
+#ifdef BL_CYCLE_STATS
+	uint32_t start = cycle_count();
+#endif
+	for (PAGE_INDEX_t i = 0; i < APP_SECTION_PAGE_SIZE; i++)
+	{
+		if (rx_head == rx_tail)
+		{
+			CYCLES_WAIT_BEGIN;
+			while (rx_head == rx_tail);
+			CYCLES_WAIT_END;
+		}
+		uint8_t c = get_char();
+		crc = _crc_xmodem_update(crc, c);
+		page_buffer[i] = c;
+	}
+#ifdef BL_CYCLE_STATS
+	cycle_stats.cycles += cycle_count() - start;
+	cycle_stats.bytes += APP_SECTION_PAGE_SIZE;
+#endif
+	return crc;
+}
+#endif
+
+/**************************************************************************************************
+* Receive a frame header and a page into page_buffer, followed by the big endian CRC16 (XMODEM)
+* of both. Returns true if the CRC matches.
+*/
+bool get_page_frame(uint8_t *header, uint8_t header_len)
+{
+	uint16_t crc = 0;
+	for (uint8_t i = 0; i < header_len; i++)
+	{
+		header[i] = get_char();
+		crc = _crc_xmodem_update(crc, header[i]);
+	}
+	crc = get_page(crc);
+	crc ^= get_char() << 8;
+	crc ^= get_char();
+	return crc == 0;
+}
+
+/**************************************************************************************************
+* Program page_buffer into an application section page, once any previous write has finished
+*/
+void write_app_page(uint16_t page)
+{
+	uint32_t address = APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE);
+	SP_WaitForSPM();
+	SP_LoadFlashPage(page_buffer);
+	if (erase_on_write)
+		SP_EraseWriteApplicationPage(address);
+	else
+		SP_WriteApplicationPage(address);
+}
+
+/**************************************************************************************************
+* Decode an LZ compressed page from compressed_buffer into page_buffer. Matches can only refer
+* back within the same page. Returns false unless the data decodes to exactly one page.
+*/
+bool decompress_page(uint16_t len)
+{
+	uint16_t in = 0;
+	uint16_t out = 0;
+
+	while (in < len)
+	{
+		uint8_t token = compressed_buffer[in++];
+		uint8_t count;
+		if (token & LZ_MATCH_FLAG)
+		{
+			if (len - in < 2)
+				return false;
+			uint16_t distance = (compressed_buffer[in] << 8) | compressed_buffer[in + 1];
+			in += 2;
+			count = (token & ~LZ_MATCH_FLAG) + LZ_MIN_MATCH;
+			if ((distance == 0) || (distance > out) || (count > APP_SECTION_PAGE_SIZE - out))
+				return false;
+			uint8_t *src = &page_buffer[out - distance];
+			while (count--)
+				page_buffer[out++] = *src++;	// overlap with the output repeats the data (RLE)
+		}
+		else
+		{
+			count = token + 1;
+			if ((count > len - in) || (count > APP_SECTION_PAGE_SIZE - out))
+				return false;
+			while (count--)
+				page_buffer[out++] = compressed_buffer[in++];
+		}
+	}
+	return out == APP_SECTION_PAGE_SIZE;
 }
 
 /**************************************************************************************************
@@ -73,8 +414,13 @@ inline uint8_t get_char_nonblocking(void)
 */
 inline void put_char(uint8_t byte)
 {
+	if (muted)
+		return;
 	while (!(BL_USART.STATUS & USART_DREIF_bm));
 	BL_USART.DATA = byte;
+	// TXCIF is sticky and gets set whenever sending pauses, e.g. while the CPU is halted for a flash
+	// CRC. Clearing it once this byte is queued means it is next set when this byte has been sent.
+	BL_USART.STATUS = USART_TXCIF_bm;
 }
 
 /**************************************************************************************************
@@ -97,6 +443,45 @@ void put_uint32(uint32_t word)
 	put_char((word >> 24) & 0xFF);
 }
 
+/**************************************************************************************************
+* Store a little endian uint32 in a buffer, returns the next position
+*/
+uint8_t *pack_uint32(uint8_t *p, uint32_t word)
+{
+	*p++ = word & 0xFF;
+	*p++ = (word >> 8) & 0xFF;
+	*p++ = (word >> 16) & 0xFF;
+	*p++ = (word >> 24) & 0xFF;
+	return p;
+}
+
+/**************************************************************************************************
+* Send an application section page straight from flash, returns its CRC16 (XMODEM). ELPM reads
+* through RAMPZ so that pages above 64K can be reached, the CRC is updated while each byte is sent.
+*/
+uint16_t put_app_page(uint16_t page)
+{
+	uint32_t address = APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE);
+	uint16_t crc = 0;
+	for (PAGE_INDEX_t i = 0; i < APP_SECTION_PAGE_SIZE; i++)
+	{
+		uint8_t c = pgm_read_byte_far(address++);
+		put_char(c);
+		crc = _crc_xmodem_update(crc, c);
+	}
+	RAMPZ = 0;
+	return crc;
+}
+
+/**************************************************************************************************
+* Set the USART baud rate registers
+*/
+void set_baudctrl(uint16_t baudctrl)
+{
+	BL_USART.BAUDCTRLA = baudctrl & 0xFF;
+	BL_USART.BAUDCTRLB = baudctrl >> 8;
+}
+
 /**************************************************************************************************
 * Write to a CCP protected register
 */
@@ -124,6 +509,27 @@ void CCPWrite(volatile uint8_t *page, uint8_t value)
         SREG = saved_sreg;
 }
 
+/**************************************************************************************************
+* Run from the 32MHz internal oscillator, kept accurate enough for the USART by the DFLL
+*/
+void clock_32mhz(void)
+{
+	OSC.CTRL |= OSC_RC32MEN_bm | OSC_RC32KEN_bm;
+	while ((OSC.STATUS & (OSC_RC32MRDY_bm | OSC_RC32KRDY_bm)) != (OSC_RC32MRDY_bm | OSC_RC32KRDY_bm));
+	DFLLRC32M.CTRL = DFLL_ENABLE_bm;		// OSC.DFLLCTRL reset value selects the 32.768kHz oscillator
+	CCPWrite(&CLK.CTRL, CLK_SCLKSEL_RC32M_gc);
+}
+
+/**************************************************************************************************
+* Return to the 2MHz reset clock before starting the application
+*/
+void clock_2mhz(void)
+{
+	CCPWrite(&CLK.CTRL, CLK_SCLKSEL_RC2M_gc);
+	DFLLRC32M.CTRL = 0;
+	OSC.CTRL = OSC_RC2MEN_bm;
+}
+
 /**************************************************************************************************
 * Main entry point
 */
@@ -138,15 +544,16 @@ int main(void)
 	
 	PORTC.DIRSET = PIN7_bm;	// USART TX
 
+	clock_32mhz();
+
 	// set up USART
-	BL_USART.BAUDCTRLA = (uint8_t)BL_BSEL;
-	BL_USART.BAUDCTRLB = (BL_BSCALE << 4) | (BL_BSEL >> 8);
-	BL_USART.CTRLA = 0;
+	set_baudctrl(BAUDCTRL(BL_BSCALE, BL_BSEL));
+	BL_USART.CTRLA = USART_RXCINTLVL_HI_gc;
 	BL_USART.CTRLB = USART_RXEN_bm | USART_TXEN_bm | BL_CLK2X;
 	BL_USART.CTRLC = USART_CMODE_ASYNCHRONOUS_gc | USART_PMODE_DISABLED_gc | USART_CHSIZE_8BIT_gc;
 
+	BL_CTRL_PORT.OUTCLR = BL_CTRL_DE_PIN_bm | BL_CTRL_nRE_PIN_bm;	// receive, TXCIF isn't set until something is sent
 	BL_CTRL_PORT.DIRSET = BL_CTRL_DE_PIN_bm | BL_CTRL_nRE_PIN_bm;
-	BL_CTRL_RX_MODE;
 
 	// timeout using RTC
 	RTC.CTRL = RTC_PRESCALER_OFF_gc;						// make sure clock isn't running while we configure it
@@ -158,6 +565,10 @@ int main(void)
 	RTC.INTCTRL = 0;
 	RTC.CTRL = RTC_PRESCALER_DIV1_gc;
 
+	CCP = CCP_IOREG_gc;				// unlock IVSEL
+	PMIC.CTRL = PMIC_IVSEL_bm | PMIC_HILVLEN_bm;	// set interrupt vector table to bootloader section
+	sei();
+
 	LED_ENABLE;
 
 	char c;
@@ -168,6 +579,9 @@ int main(void)
 			// exit bootloader
 			LED_DISABLE;
 			RTC.CTRL = 0;
+			cli();
+			BL_USART.CTRLA = 0;		// the application starts with the USART interrupt off
+			clock_2mhz();
 			AppPtr application_vector = (AppPtr)0x000000;
 			CCP = CCP_IOREG_gc;		// unlock IVSEL
 			PMIC.CTRL = 0;			// disable interrupts, set vector table to app section
@@ -176,21 +590,40 @@ int main(void)
 			application_vector();
 		}
 		c = get_char_nonblocking();
-	} while (c != CMD_NOP);
+	} while ((c != CMD_NOP) && (c != CMD_BROADCAST));
+	if (c == CMD_BROADCAST)
+		muted = true;		// every node on the bus is starting, only answer once selected
 	BL_CTRL_TX_MODE;
 	put_char(RES_OK);	// acknowledge start of bootloader
 	BL_CTRL_RX_MODE;
 	LED_DISABLE;
 
-	//CCP = CCP_IOREG_gc;				// unlock IVSEL
-	//PMIC.CTRL |= PMIC_IVSEL_bm;		// set interrupt vector table to bootloader section
+#ifdef BL_PAGE_DMA
+	DMA.CTRL = DMA_ENABLE_bm;
+	BL_DMA_CH.ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_FIXED_gc | DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_INC_gc;
+	BL_DMA_CH.TRIGSRC = BL_DMA_TRIGSRC;
+	BL_DMA_CH.SRCADDR0 = (uint16_t)&BL_USART.DATA & 0xFF;
+	BL_DMA_CH.SRCADDR1 = (uint16_t)&BL_USART.DATA >> 8;
+	BL_DMA_CH.SRCADDR2 = 0;
+	BL_DMA_CH.DESTADDR2 = 0;
+#endif
+#ifdef BL_CYCLE_STATS
+	EVSYS.CH0MUX = EVSYS_CHMUX_TCC0_OVF_gc;
+	TCC1.CTRLA = TC_CLKSEL_EVCH0_gc;
+	TCC0.CTRLA = TC_CLKSEL_DIV1_gc;
+#endif
 	
 	// bootloader
 	for(;;)
 	{
-		c = get_char();
+		c = get_command();
 		asm("wdr");
 		LED_TOGGLE;
+		// page writes load the NVM buffer after receiving the page and NOPs pad out windowed frames,
+		// neither should block on the previous write
+		if ((c != CMD_NOP) && (c != CMD_WRITE_PAGE_PIPELINED) && (c != CMD_WRITE_PAGE_FRAMED) &&
+			(c != CMD_WRITE_PAGE_WINDOWED) && (c != CMD_WRITE_PAGE_COMPRESSED))
+			SP_WaitForSPM();	// finish any pipelined page write before doing anything else
 		switch (c)
 		{
 			
@@ -203,6 +636,7 @@ int main(void)
 				break;
 			
 			case CMD_WRITE_PAGE:
+			case CMD_WRITE_PAGE_PIPELINED:
 			{
 				uint16_t page;
 				page = get_char() << 8;
@@ -218,12 +652,102 @@ int main(void)
 				put_char(RES_OK);
 				BL_CTRL_RX_MODE;
 				
-				for (PAGE_INDEX_t i = 0; i < APP_SECTION_PAGE_SIZE; i++)
-					page_buffer[i] = get_char();
-				SP_WaitForSPM();
-				SP_LoadFlashPage(page_buffer);
-				SP_WriteApplicationPage(APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE));
-				SP_WaitForSPM();
+				get_page(0);
+				write_app_page(page);
+				// Pipelined writes are acknowledged as soon as the page is in the NVM page buffer, so
+				// the next page is received into page_buffer while this one is being programmed.
+				if (c == CMD_WRITE_PAGE)
+					SP_WaitForSPM();
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
+				break;
+			}
+			
+			// page number, data and CRC16 (XMODEM) of both in a single frame, one response per page
+			case CMD_WRITE_PAGE_FRAMED:
+			{
+				uint8_t header[2];
+				bool ok = get_page_frame(header, sizeof(header));
+				uint16_t page = (header[0] << 8) | header[1];
+				if (!ok || (page >= APP_SECTION_NUM_PAGES))
+				{
+					BL_CTRL_TX_MODE;
+					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
+					break;
+				}
+				write_app_page(page);
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
+				break;
+			}
+			
+			// Sequence number, page number, data and CRC16, with no response. Frames received
+			// intact are cleared from window_naks, which the host reads with CMD_WINDOW_STATUS
+			// at the end of each window and then resends the rest. The host follows every frame
+			// with NOPs, so a frame that lost bytes ends in the NOPs rather than the next frame.
+			case CMD_WRITE_PAGE_WINDOWED:
+			{
+				uint8_t header[3];
+				bool ok = get_page_frame(header, sizeof(header));
+				uint16_t page = (header[1] << 8) | header[2];
+				if (!ok || (page >= APP_SECTION_NUM_PAGES))
+					break;
+				write_app_page(page);
+				window_naks &= ~(1UL << (header[0] % WINDOW_MAX_FRAMES));
+				break;
+			}
+			
+			case CMD_WINDOW_STATUS:
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				put_uint32(window_naks);
+				BL_CTRL_RX_MODE;
+				window_naks = 0xFFFFFFFF;
+				break;
+			
+			// page number, compressed length, compressed data and CRC16 of everything before it.
+			// The data is consumed so that a bad frame can't be mistaken for commands. A corrupt
+			// length could be anything up to 64 KB, so that frame is dropped up to the end of the
+			// host's transmission instead, then rejected.
+			case CMD_WRITE_PAGE_COMPRESSED:
+			{
+				uint8_t header[4];
+				uint16_t crc = 0;
+				for (uint8_t i = 0; i < sizeof(header); i++)
+				{
+					header[i] = get_char();
+					crc = _crc_xmodem_update(crc, header[i]);
+				}
+				uint16_t page = (header[0] << 8) | header[1];
+				uint16_t len = (header[2] << 8) | header[3];
+				if ((len == 0) || (len > sizeof(compressed_buffer)))
+				{
+					wait_bus_idle();
+					BL_CTRL_TX_MODE;
+					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
+					break;
+				}
+				for (uint16_t i = 0; i < len; i++)
+				{
+					c = get_char();
+					crc = _crc_xmodem_update(crc, c);
+					compressed_buffer[i] = c;
+				}
+				crc ^= get_char() << 8;
+				crc ^= get_char();
+
+				if ((crc != 0) || (page >= APP_SECTION_NUM_PAGES) || !decompress_page(len))
+				{
+					BL_CTRL_TX_MODE;
+					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
+					break;
+				}
+				write_app_page(page);
 				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
 				BL_CTRL_RX_MODE;
@@ -235,60 +759,190 @@ int main(void)
 				uint16_t page;
 				page = get_char() << 8;
 				page |= get_char();
+				BL_CTRL_TX_MODE;
 				if (page >= APP_SECTION_NUM_PAGES)
 				{
 					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
 					break;
 				}
 				put_char(RES_OK);
-				page *= APP_SECTION_PAGE_SIZE;
-				
 				put_uint16(APP_SECTION_PAGE_SIZE);
-				for (PAGE_INDEX_t i = 0; i < APP_SECTION_PAGE_SIZE; i++)
-					put_char(*(uint8_t *)page++);
+				put_app_page(page);
+				BL_CTRL_RX_MODE;
+				break;
+			}
+
+			// stream count pages at line rate, each followed by its CRC16
+			case CMD_READ_PAGES:
+			{
+				uint16_t page, count;
+				page = get_char() << 8;
+				page |= get_char();
+				count = get_char() << 8;
+				count |= get_char();
+				BL_CTRL_TX_MODE;
+				if ((page >= APP_SECTION_NUM_PAGES) || (count > APP_SECTION_NUM_PAGES - page))
+				{
+					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
+					break;
+				}
+				put_char(RES_OK);
+				while (count--)
+					put_uint16(put_app_page(page++));
+				BL_CTRL_RX_MODE;
 				break;
 			}
 			
 			case CMD_READ_FLASH_CRCS:
+			{
+				uint32_t app_crc = SP_ApplicationCRC();
+				uint32_t boot_crc = SP_BootCRC();
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				put_uint32(app_crc);
+				put_uint32(boot_crc);
+				BL_CTRL_RX_MODE;
+				break;
+			}
+
+			case CMD_READ_PAGE_CRCS:
+			{
+				uint16_t page, count;
+				page = get_char() << 8;
+				page |= get_char();
+				count = get_char() << 8;
+				count |= get_char();
+				BL_CTRL_TX_MODE;
+				if ((page >= APP_SECTION_NUM_PAGES) || (count > APP_SECTION_NUM_PAGES - page))
+				{
+					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
+					break;
+				}
+				put_char(RES_OK);
+				uint32_t addr = APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE);
+				while (count--)
+				{
+					uint32_t crc = SP_FlashRangeCRC(addr, addr + APP_SECTION_PAGE_SIZE - 1);
+					put_char(crc & 0xFF);
+					put_char((crc >> 8) & 0xFF);
+					put_char((crc >> 16) & 0xFF);
+					addr += APP_SECTION_PAGE_SIZE;
+				}
+				BL_CTRL_RX_MODE;
+				break;
+			}
+
+			case CMD_ERASE_PAGE:
+			{
+				uint16_t page;
+				page = get_char() << 8;
+				page |= get_char();
+				BL_CTRL_TX_MODE;
+				if (page >= APP_SECTION_NUM_PAGES)
+				{
+					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
+					break;
+				}
+				// the next command waits for the erase to finish
+				SP_EraseApplicationPage(APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE));
+				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
+				break;
+			}
+
+			// followed by 1 to erase each page as it is written instead of erasing the whole
+			// application section first, or 0 to only write
+			case CMD_ERASE_ON_WRITE:
+				erase_on_write = get_char();
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
-				put_uint32(SP_ApplicationCRC());
-				put_uint32(SP_BootCRC());
+				BL_CTRL_RX_MODE;
 				break;
 
 			case CMD_READ_MCU_IDS:
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
 				put_uint16(4);
 				put_char(MCU.DEVID0);
 				put_char(MCU.DEVID1);
 				put_char(MCU.DEVID2);
 				put_char(MCU.REVID);
+				BL_CTRL_RX_MODE;
 				break;
 			
 			case CMD_READ_SERIAL:
 			{
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
-				put_uint16(11);
-				for (uint8_t i = 0; i < 11; i++)
+				put_uint16(NODE_SERIAL_LENGTH);
+				for (uint8_t i = 0; i < NODE_SERIAL_LENGTH; i++)
 					put_char(SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i));
+				BL_CTRL_RX_MODE;
+				break;
+			}
+			
+			case CMD_BROADCAST:
+				muted = true;
+				deselected = false;
+				break;
+			
+			// the addressed node unmutes and acknowledges, all others ignore the bus until selected
+			case CMD_SELECT_NODE:
+			{
+				bool match = true;
+				for (uint8_t i = 0; i < NODE_SERIAL_LENGTH; i++)
+				{
+					if (get_char() != SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i))
+						match = false;
+				}
+				muted = !match;
+				deselected = !match;
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
 				break;
 			}
 			
+			// page reception cost, F_CPU then the CYCLE_STATS_t counters
+			case CMD_READ_CYCLE_STATS:
+				BL_CTRL_TX_MODE;
+#ifdef BL_CYCLE_STATS
+				put_char(RES_OK);
+				put_uint32(F_CPU);
+				put_uint32(cycle_stats.bytes);
+				put_uint32(cycle_stats.cycles);
+				put_uint32(cycle_stats.wait_cycles);
+#else
+				put_char(RES_FAIL);
+#endif
+				BL_CTRL_RX_MODE;
+				break;
+			
 			case CMD_READ_BOOTLOADER_VERSION:
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
 				put_char(BOOTLOADER_VERSION);
+				BL_CTRL_RX_MODE;
 				break;
 			
 			case CMD_RESET_MCU:
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
-				_delay_ms(10);
+				BL_CTRL_RX_MODE;	// ack is sent before the reset
 				CCPWrite(&RST.CTRL, RST_SWRST_bm);
 				nop();
 				break;
 			
 			case CMD_READ_FUSES:
 			{
+				BL_CTRL_TX_MODE;
 				for (uint8_t i = 0; i < 6; i++)
 					put_char(SP_ReadFuseByte(i));
+				BL_CTRL_RX_MODE;
 				break;
 			}
 
@@ -297,9 +951,11 @@ int main(void)
 				uint16_t page;
 				page = get_char() << 8;
 				page |= get_char();
+				BL_CTRL_TX_MODE;
 				if (page >= EEPROM_NUM_PAGES)
 				{
 					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
 					break;
 				}
 				put_char(RES_OK);
@@ -309,6 +965,7 @@ int main(void)
 				put_uint16(EEPROM_PAGE_SIZE);
 				for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; i++)
 					put_char(*ptr++);
+				BL_CTRL_RX_MODE;
 				break;
 			}
 			
@@ -317,33 +974,42 @@ int main(void)
 				uint16_t page;
 				page = get_char() << 8;
 				page |= get_char();
+				BL_CTRL_TX_MODE;
 				if (page >= EEPROM_NUM_PAGES)
 				{
 					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
 					break;
 				}
 				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
 				page *= EEPROM_PAGE_SIZE;
 				uint8_t *ptr = (uint8_t *)page + MAPPED_EEPROM_START;
 				for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; i++)
 					*ptr++ = get_char();
 				EEP_AtomicWritePage(page);
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
 				break;
 			}
 
 			case CMD_ERASE_USER_SIG_ROW:
 				SP_WaitForSPM();
 				SP_EraseUserSignatureRow();
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
 				break;
 			
 			case CMD_READ_USER_SIG_ROW:
 			{
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
 				put_uint16(USER_SIGNATURES_PAGE_SIZE);
 				for (PAGE_INDEX_t i = 0; i < USER_SIGNATURES_PAGE_SIZE; i++)
 					put_char(SP_ReadUserSignatureByte(i));
+				BL_CTRL_RX_MODE;
 				break;
 			}
 			
@@ -354,11 +1020,88 @@ int main(void)
 				SP_WaitForSPM();
 				SP_LoadFlashPage(page_buffer);
 				SP_WriteUserSignatureRow();
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
 				break;
 			}
 			
+			case CMD_SET_BAUD:
+			{
+				uint16_t rate;
+				rate = get_char() << 8;
+				rate |= get_char();
+				uint8_t i;
+				for (i = 0; i < BAUD_TABLE_SIZE; i++)
+				{
+					if (baud_table[i].rate_100 == rate)
+						break;
+				}
+				BL_CTRL_TX_MODE;
+				if (i >= BAUD_TABLE_SIZE)
+				{
+					put_char(RES_FAIL);
+					BL_CTRL_RX_MODE;
+					break;
+				}
+				put_char(RES_OK);
+				BL_CTRL_RX_MODE;	// waits for the ack to finish sending at the old rate
+				set_baudctrl(baud_table[i].baudctrl);
+
+				// host confirms with CMD_NOP at the new rate, otherwise fall back to the default
+				uint16_t start = RTC.CNT;
+				do
+				{
+					c = get_char_nonblocking();
+				} while ((c != CMD_NOP) && ((uint16_t)(RTC.CNT - start) < BAUD_CONFIRM_TIMEOUT));
+				if (c != CMD_NOP)
+				{
+					set_baudctrl(BAUDCTRL(BL_BSCALE, BL_BSEL));
+					break;
+				}
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
+				break;
+			}
+
+			// everything the host checks before an update, in one turnaround
+			case CMD_READ_INFO:
+			{
+				uint8_t info[BOOTLOADER_INFO_LENGTH];
+				uint8_t *p = info;
+				*p++ = BOOTLOADER_VERSION;
+				*p++ = MCU.DEVID0;
+				*p++ = MCU.DEVID1;
+				*p++ = MCU.DEVID2;
+				*p++ = MCU.REVID;
+				for (uint8_t i = 0; i < NODE_SERIAL_LENGTH; i++)
+					*p++ = SP_ReadCalibrationByte(offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0) + i);
+				for (uint8_t i = 0; i < 6; i++)
+					*p++ = SP_ReadFuseByte(i);
+				p = pack_uint32(p, APP_SECTION_PAGE_SIZE);
+				p = pack_uint32(p, APP_SECTION_SIZE);
+				p = pack_uint32(p, BOOT_SECTION_PAGE_SIZE);
+				p = pack_uint32(p, BOOT_SECTION_SIZE);
+				p = pack_uint32(p, EEPROM_PAGE_SIZE);
+				pack_uint32(p, EEPROM_SIZE);
+
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				put_uint16(BOOTLOADER_INFO_LENGTH);
+				uint16_t crc = 0;
+				for (uint8_t i = 0; i < BOOTLOADER_INFO_LENGTH; i++)
+				{
+					put_char(info[i]);
+					crc = _crc_xmodem_update(crc, info[i]);
+				}
+				put_uint16(crc);
+				BL_CTRL_RX_MODE;
+				break;
+			}
+
 			case CMD_READ_MEMORY_SIZES:
+				BL_CTRL_TX_MODE;
 				put_char(RES_OK);
 				put_uint32(APP_SECTION_PAGE_SIZE);
 				put_uint32(APP_SECTION_SIZE);
@@ -366,7 +1109,21 @@ int main(void)
 				put_uint32(BOOT_SECTION_SIZE);
 				put_uint32(EEPROM_PAGE_SIZE);
 				put_uint32(EEPROM_SIZE);
+				BL_CTRL_RX_MODE;
+				break;
+			
+			// microseconds to wait before driving the bus, acknowledged with the old setting
+			case CMD_SET_TURNAROUND:
+			{
+				uint16_t us;
+				us = get_char() << 8;
+				us |= get_char();
+				BL_CTRL_TX_MODE;
+				put_char(RES_OK);
+				BL_CTRL_RX_MODE;
+				turnaround_10us = us / 10 + (us % 10 != 0);		// rounded up without overflowing
 				break;
+			}
 		}
 	}
 }
@@ -16,8 +16,17 @@
 #define	CMD_NOP						'n'
 #define CMD_ERASE_APP_SECTION		'!'
 #define CMD_WRITE_PAGE				'W'
+#define CMD_WRITE_PAGE_PIPELINED	'P'
+#define CMD_WRITE_PAGE_FRAMED		'w'
+#define CMD_WRITE_PAGE_WINDOWED		'Q'
+#define CMD_WINDOW_STATUS			'k'
+#define CMD_WRITE_PAGE_COMPRESSED	'z'
 #define CMD_READ_PAGE				'r'
+#define CMD_READ_PAGES				'R'		// followed by a start page and count, each page is followed by its CRC16
 #define CMD_READ_FLASH_CRCS			'c'
+#define CMD_READ_PAGE_CRCS			'C'
+#define CMD_ERASE_PAGE				'x'
+#define CMD_ERASE_ON_WRITE			'o'		// followed by 1 for page writes to erase the page first
 #define CMD_READ_MCU_IDS			'i'
 #define CMD_READ_SERIAL				's'
 #define CMD_READ_BOOTLOADER_VERSION	'v'
@@ -29,6 +38,37 @@
 #define CMD_READ_USER_SIG_ROW		'u'
 #define CMD_WRITE_USER_SIG_ROW		'U'
 #define CMD_READ_MEMORY_SIZES		'm'
+#define CMD_SET_BAUD				'b'
+#define CMD_BROADCAST				'B'		// enter or stay in the bootloader without responding, see BROADCAST_MAGIC
+#define CMD_SELECT_NODE				'N'		// followed by a node serial, only that node responds
+#define CMD_SET_TURNAROUND			'T'		// followed by the delay before responding in microseconds
+#define CMD_READ_CYCLE_STATS		'y'		// CPU cycles spent receiving pages, BL_CYCLE_STATS builds only
+#define CMD_READ_INFO				'I'		// 'v', 'i', 's', 'f' and 'm' as one record, followed by its CRC16
+
+// CMD_WRITE_PAGE_WINDOWED
+#define WINDOW_MAX_FRAMES			32		// sequence numbers are tracked modulo this
+
+// CMD_BROADCAST, a deselected node only rejoins on the full preamble. The magic bytes are not
+// commands so nodes that are listening ignore them.
+#define BROADCAST_MAGIC_LENGTH		3
+#define BROADCAST_MAGIC				{ 0xB7, 0xC4, 0x9E }
+
+// CMD_SELECT_NODE
+#define NODE_SERIAL_LENGTH			14		// production signature LOTNUM0 to COORDY1
+
+// CMD_WRITE_PAGE_COMPRESSED tokens
+#define LZ_MATCH_FLAG				0x80	// set for a match, clear for a run of literals
+#define LZ_MAX_LITERALS				128		// token 0x00-0x7F, followed by token + 1 literal bytes
+#define LZ_MIN_MATCH				3		// token 0x80-0xFF copies (token & 0x7F) + LZ_MIN_MATCH bytes
+#define LZ_MAX_MATCH				(0x7F + LZ_MIN_MATCH)	// from a big endian distance back in the page
+
+// CMD_READ_INFO record offsets, values are little endian
+#define INFO_VERSION				0
+#define INFO_MCU_ID					1		// DEVID0-2, REVID
+#define INFO_SERIAL					5
+#define INFO_FUSES					(INFO_SERIAL + NODE_SERIAL_LENGTH)
+#define INFO_MEMORY_SIZES			(INFO_FUSES + 6)		// CMD_READ_MEMORY_SIZES, six uint32s
+#define BOOTLOADER_INFO_LENGTH		(INFO_MEMORY_SIZES + 6 * 4)
 
 
 #endif /* PROTOCOL_H_ */
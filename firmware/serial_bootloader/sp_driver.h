@@ -274,6 +274,15 @@ uint32_t SP_ApplicationCRC(void);
  */
 uint32_t SP_BootCRC(void);
 
+/*! \brief Generate CRC from a range of flash.
+ *
+ *  \param start_address  Byte address of the first byte in the range.
+ *  \param end_address    Byte address of the last byte in the range.
+ *
+ *  \retval 24-bit CRC value
+ */
+uint32_t SP_FlashRangeCRC(uint32_t start_address, uint32_t end_address);
+
 /*! \brief Lock SPM instruction.
  *
  *   This function locks the SPM instruction, and will disable the use of
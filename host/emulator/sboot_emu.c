@@ -0,0 +1,1288 @@
+// sboot_emu.c : Emulates the serial bootloader behind a Linux pseudo-terminal.
+//
+// Build:	cc -O2 -pthread -o sboot_emu sboot_emu.c ../sboot/crc.c
+// Usage:	sboot_emu [-m mcu] [-b baud] [-l latency] [-e interval] [-n nodes] [-c MHz] [-q]
+//
+// The emulator prints the name of the pty slave, which can be passed to sboot in place of a real
+// serial port. It mirrors the command handling in firmware/serial_bootloader/main.c and models the
+// parts of the hardware that matter for throughput: the baud rate (bytes are paced on both
+// directions), the interrupt ring buffer and USART receive FIFO (bytes that arrive while they are
+// full are dropped), the RS485 direction switching delays (the receiver is disabled while
+// transmitting), the NVM erase/write times and CPU bound work at the bootloader's clock.
+//
+// With -n several nodes share the pty as an RS485 bus. Each runs the bootloader in its own thread
+// with its own flash and serial number, sees everything the host and the other nodes send, and
+// overlapping transmissions are counted as collisions.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "../../firmware/serial_bootloader/protocol.h"
+#include "../sboot/crc.h"
+
+
+#define BOOTLOADER_VERSION		7
+
+// timings in microseconds, approximate values for XMEGA A/AU devices
+#define	PAGE_ERASE_US			4000
+#define	PAGE_WRITE_US			4000
+#define	APP_SECTION_ERASE_US	50000
+#define	EEPROM_WRITE_US			8000
+// CPU bound work in clock cycles
+#define	PAGE_LOAD_CYCLES_PER_WORD	10		// SP_LoadFlashPage() loop
+#define	DECODE_CYCLES_PER_BYTE	8			// decompress_page()
+#define	CRC_CYCLES_PER_KB		500			// NVM controller CRC
+#define	DEFAULT_CPU_MHZ			32
+#define	TURNAROUND_US			11000		// BL_TURNAROUND_US, BL_CTRL_TX_MODE delay until CMD_SET_TURNAROUND
+#define	BOOTLOADER_WINDOW_US	2000000
+#define	BAUD_CONFIRM_US			500000		// BAUD_CONFIRM_TIMEOUT RTC ticks
+#define	RX_FIFO_DEPTH			(255 + 3)	// interrupt ring buffer + USART 2 byte buffer + shift register
+#define	DEFAULT_LATENCY_US		2000		// USB-serial adapter round trip
+
+#define	RX_QUEUE_SIZE			65536
+#define	MAX_NODES				16
+#define	BUS_IDLE_US				3000		// BUS_IDLE_TICKS
+
+
+typedef struct {
+	const char	*name;
+	uint8_t		id[3];
+	uint32_t	app_section_size;
+	uint32_t	app_section_page_size;
+	uint32_t	boot_section_size;
+	uint32_t	boot_section_page_size;
+	uint32_t	eeprom_size;
+	uint32_t	eeprom_page_size;
+} MCU_t;
+
+const MCU_t mcu_list[] = {
+	{ "64a1u",	{ 0x1E, 0x96, 0x4E },	0x10000,	256,	0x1000,	256,	2048,	32 },
+	{ "128a1u",	{ 0x1E, 0x97, 0x4C },	0x20000,	512,	0x2000,	512,	2048,	32 },
+	{ "256a3u",	{ 0x1E, 0x98, 0x42 },	0x40000,	512,	0x2000,	512,	4096,	32 },
+	{ NULL }
+};
+
+const MCU_t *mcu = &mcu_list[0];
+__thread unsigned int baud = 19200;
+unsigned int default_baud = 19200;
+const unsigned int baud_table[] = { 19200, 38400, 57600, 76800, 115200, 230400, 460800, 921600, 1000000, 2000000, 0 };
+unsigned int cpu_mhz = DEFAULT_CPU_MHZ;
+unsigned int latency_us = DEFAULT_LATENCY_US;
+bool opt_quiet = false;
+unsigned int error_interval = 0;	// corrupt every nth received byte
+unsigned int num_nodes = 1;
+
+int pty_fd = -1;
+const uint8_t fuses[6] = { 0xFF, 0x00, 0xBF, 0xFF, 0xFF, 0xFF };
+
+// receive queue, filled with the time each byte finished arriving at the USART and the baud rate it
+// was sent at. One per node, the host and every other node write to it.
+typedef struct {
+	uint8_t		data[RX_QUEUE_SIZE];
+	uint64_t	arrival_us[RX_QUEUE_SIZE];
+	unsigned int rate[RX_QUEUE_SIZE];
+	unsigned int head, tail;
+	uint64_t	last_arrival_us;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+} RXQ_t;
+
+RXQ_t rx_queues[MAX_NODES];
+pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t bus_busy_until_us = 0;		// end of the last byte a node drove onto the bus
+int bus_owner = -1;
+unsigned long collisions = 0;
+
+// per node state
+__thread unsigned int node_index = 0;
+__thread RXQ_t *rxq = NULL;
+__thread uint8_t *flash = NULL;
+__thread uint8_t *eeprom = NULL;
+__thread uint8_t user_sig_row[512];
+__thread uint8_t production_sig[NODE_SERIAL_LENGTH] = { 'E', 'M', 'U', 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x00, 0x00, 0x00 };
+__thread uint8_t *page_buffer = NULL;
+__thread uint32_t window_naks = 0xFFFFFFFF;
+__thread bool muted = false;
+__thread bool deselected = false;
+__thread unsigned int turnaround_us = TURNAROUND_US;
+__thread bool erase_on_write = false;
+
+__thread uint64_t fw_time_us = 0;			// emulated firmware time, the wall clock is kept in step with it
+__thread uint64_t tx_free_us = 0;			// time the transmitter finishes the last queued byte
+__thread uint64_t nvm_busy_until_us = 0;
+__thread bool tx_mode = false;
+__thread uint64_t tx_mode_start_us = 0;
+
+__thread struct {
+	unsigned long	rx_bytes;
+	unsigned long	tx_bytes;
+	unsigned long	overruns;
+	unsigned long	rx_while_tx;
+	unsigned long	tx_without_de;
+	unsigned long	pages_written;
+	unsigned long	baud_errors;
+} stats;
+unsigned long injected_errors = 0;
+
+
+/**************************************************************************************************
+* Monotonic time in microseconds
+*/
+uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_until_us(uint64_t t)
+{
+	uint64_t now = now_us();
+	if (t <= now)
+		return;
+	struct timespec ts = { (t - now) / 1000000, ((t - now) % 1000000) * 1000 };
+	nanosleep(&ts, NULL);
+}
+
+uint64_t byte_time_at_us(unsigned int rate)
+{
+	return (10 * 1000000ULL + rate - 1) / rate;		// 8N1
+}
+
+uint64_t byte_time_us(void)
+{
+	return byte_time_at_us(baud);
+}
+
+void log_msg(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+#include <stdarg.h>
+void log_msg(const char *fmt, ...)
+{
+	if (opt_quiet)
+		return;
+	va_list ap;
+	va_start(ap, fmt);
+	if (num_nodes > 1)
+		fprintf(stderr, "[%u] ", node_index);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+/**************************************************************************************************
+* Baud rate the host has set on its end of the pty, 0 if unknown
+*/
+unsigned int host_baud(void)
+{
+	static const struct { speed_t speed; unsigned int baud; } speeds[] = {
+		{ B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+		{ B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 }, { B500000, 500000 },
+		{ B921600, 921600 }, { B1000000, 1000000 }, { B2000000, 2000000 },
+	};
+	struct termios tio;
+	if (tcgetattr(pty_fd, &tio) != 0)
+		return 0;
+	speed_t speed = cfgetospeed(&tio);
+	for (unsigned int i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+	{
+		if (speeds[i].speed == speed)
+			return speeds[i].baud;
+	}
+
+#ifdef TCGETS2
+	// libserialport sets rates above 460800 as a number with termios2, <asm/termbits.h> clashes
+	// with <termios.h> so the parts needed are repeated here
+	#ifndef BOTHER
+		#define	BOTHER	0010000
+	#endif
+	struct termios2_speed {
+		tcflag_t	c_iflag, c_oflag, c_cflag, c_lflag;
+		cc_t		c_line;
+		cc_t		c_cc[19];
+		speed_t		c_ispeed, c_ospeed;
+	} tio2;
+	if ((speed == BOTHER) && (ioctl(pty_fd, _IOR('T', 0x2A, struct termios2_speed), &tio2) == 0))
+		return tio2.c_ospeed;
+#endif
+	return 0;
+}
+
+// bytes sent at the wrong rate arrive as garbage
+bool baud_mismatch(unsigned int rate)
+{
+	if ((rate == 0) || (rate == baud))
+		return false;
+	stats.baud_errors++;
+	return true;
+}
+
+/**************************************************************************************************
+* Put bytes on the bus, arriving at every node except the sender. Called with no queues locked.
+*/
+void bus_deliver(int sender, const uint8_t *buf, size_t n, uint64_t t, unsigned int rate)
+{
+	for (unsigned int node = 0; node < num_nodes; node++)
+	{
+		if ((int)node == sender)
+			continue;
+		RXQ_t *q = &rx_queues[node];
+		pthread_mutex_lock(&q->lock);
+		uint64_t arrival = t;
+		for (size_t i = 0; i < n; i++)
+		{
+			unsigned int next = (q->head + 1) % RX_QUEUE_SIZE;
+			if (next == q->tail)
+				break;
+			if (arrival < q->last_arrival_us)
+				arrival = q->last_arrival_us;
+			arrival += byte_time_at_us(rate ? rate : default_baud);
+			q->last_arrival_us = arrival;
+			q->data[q->head] = buf[i];
+			q->arrival_us[q->head] = arrival;
+			q->rate[q->head] = rate;
+			q->head = next;
+		}
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+/**************************************************************************************************
+* Reader thread, timestamps bytes from the host as they would arrive on the wire
+*/
+void *reader_thread(void *arg)
+{
+	(void)arg;
+	uint8_t buf[256];
+	unsigned long rx_count = 0;
+
+	for (;;)
+	{
+		ssize_t n = read(pty_fd, buf, sizeof(buf));
+		if (n <= 0)
+		{
+			usleep(1000);		// no host connected
+			continue;
+		}
+
+		for (ssize_t i = 0; i < n; i++)
+		{
+			if (error_interval && ((++rx_count % error_interval) == 0))
+			{
+				buf[i] ^= 0x01;
+				injected_errors++;
+			}
+		}
+		bus_deliver(-1, buf, n, now_us() + latency_us, host_baud());
+	}
+	return NULL;
+}
+
+/**************************************************************************************************
+* Drop bytes that the USART could not hold. Called with the queue locked.
+*/
+void apply_overruns(uint64_t now)
+{
+	// bytes that arrived while the transmitter had the RS485 bus are never seen by the receiver
+	while ((rxq->tail != rxq->head) && tx_mode && (rxq->arrival_us[rxq->tail] >= tx_mode_start_us) && (rxq->arrival_us[rxq->tail] <= now))
+	{
+		rxq->tail = (rxq->tail + 1) % RX_QUEUE_SIZE;
+		stats.rx_while_tx++;
+	}
+
+	// the FIFO holds RX_FIFO_DEPTH bytes that arrived since the firmware last read
+	unsigned int held = 0;
+	unsigned int i = rxq->tail;
+	while ((i != rxq->head) && (rxq->arrival_us[i] <= now))
+	{
+		if (held < RX_FIFO_DEPTH)
+		{
+			held++;
+			i = (i + 1) % RX_QUEUE_SIZE;
+			continue;
+		}
+		// overrun, remove byte i
+		unsigned int j = i;
+		while (j != rxq->tail)
+		{
+			unsigned int prev = (j + RX_QUEUE_SIZE - 1) % RX_QUEUE_SIZE;
+			rxq->data[j] = rxq->data[prev];
+			rxq->arrival_us[j] = rxq->arrival_us[prev];
+			j = prev;
+		}
+		rxq->tail = (rxq->tail + 1) % RX_QUEUE_SIZE;
+		stats.overruns++;
+		i = (i + 1) % RX_QUEUE_SIZE;
+	}
+}
+
+/**************************************************************************************************
+* Get a character from the emulated USART. Returns -1 on timeout if deadline_us is non-zero.
+*/
+int get_char_deadline(uint64_t deadline_us)
+{
+	pthread_mutex_lock(&rxq->lock);
+	apply_overruns(fw_time_us);
+	for (;;)
+	{
+		if (rxq->tail != rxq->head)
+		{
+			uint64_t t = rxq->arrival_us[rxq->tail];
+			if (deadline_us && (t > deadline_us))
+				break;
+			uint8_t c = rxq->data[rxq->tail];
+			if (baud_mismatch(rxq->rate[rxq->tail]))
+				c ^= 0x55;
+			rxq->tail = (rxq->tail + 1) % RX_QUEUE_SIZE;
+			pthread_mutex_unlock(&rxq->lock);
+			if (t > fw_time_us)
+				fw_time_us = t;
+			sleep_until_us(fw_time_us);
+			stats.rx_bytes++;
+			return c;
+		}
+
+		uint64_t now = now_us();
+		if (now > fw_time_us)
+			fw_time_us = now;		// idle
+		if (deadline_us)
+		{
+			if (now >= deadline_us)
+				break;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			uint64_t wait = deadline_us - now;
+			ts.tv_sec += wait / 1000000;
+			ts.tv_nsec += (wait % 1000000) * 1000;
+			if (ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&rxq->cond, &rxq->lock, &ts);
+		}
+		else
+			pthread_cond_wait(&rxq->cond, &rxq->lock);
+	}
+	pthread_mutex_unlock(&rxq->lock);
+	fw_time_us = deadline_us;
+	return -1;
+}
+
+uint8_t get_char(void)
+{
+	return (uint8_t)get_char_deadline(0);
+}
+
+/**************************************************************************************************
+* Discard everything received until the bus has been quiet for BUS_IDLE_US
+*/
+void wait_bus_idle(void)
+{
+	while (get_char_deadline(fw_time_us + BUS_IDLE_US) >= 0);
+}
+
+/**************************************************************************************************
+* Get the next command, a deselected node only accepts a select or broadcast preamble after the bus
+* goes quiet
+*/
+uint8_t get_command(void)
+{
+	static const uint8_t magic[BROADCAST_MAGIC_LENGTH] = BROADCAST_MAGIC;
+
+	if (!deselected)
+		return get_char();
+
+	for (;;)
+	{
+		wait_bus_idle();
+		int c = get_char();
+		if (c == CMD_SELECT_NODE)
+			return c;
+		if (c == CMD_BROADCAST)
+		{
+			uint8_t i = 0;
+			while ((i < BROADCAST_MAGIC_LENGTH) && (get_char() == magic[i]))
+				i++;
+			if (i == BROADCAST_MAGIC_LENGTH)
+				return c;
+		}
+	}
+}
+
+/**************************************************************************************************
+* Receive a frame header and page into page_buffer followed by a CRC16, true if the CRC matches
+*/
+bool get_page_frame(uint8_t *header, unsigned int header_len)
+{
+	for (unsigned int i = 0; i < header_len; i++)
+		header[i] = get_char();
+	for (unsigned int i = 0; i < mcu->app_section_page_size; i++)
+		page_buffer[i] = get_char();
+	uint16_t crc = crc16_xmodem(0, header, header_len);
+	crc = crc16_xmodem(crc, page_buffer, mcu->app_section_page_size);
+	crc ^= get_char() << 8;
+	crc ^= get_char();
+	return crc == 0;
+}
+
+void busy(uint64_t us);
+
+/**************************************************************************************************
+* Decode an LZ compressed page into page_buffer, as decompress_page() in the firmware
+*/
+bool decompress_page(const uint8_t *in, unsigned int len)
+{
+	unsigned int i = 0;
+	unsigned int out = 0;
+	unsigned int page_size = mcu->app_section_page_size;
+
+	while (i < len)
+	{
+		uint8_t token = in[i++];
+		unsigned int count;
+		if (token & LZ_MATCH_FLAG)
+		{
+			if (len - i < 2)
+				return false;
+			unsigned int distance = (in[i] << 8) | in[i + 1];
+			i += 2;
+			count = (token & ~LZ_MATCH_FLAG) + LZ_MIN_MATCH;
+			if ((distance == 0) || (distance > out) || (count > page_size - out))
+				return false;
+			while (count--)
+			{
+				page_buffer[out] = page_buffer[out - distance];
+				out++;
+			}
+		}
+		else
+		{
+			count = token + 1;
+			if ((count > len - i) || (count > page_size - out))
+				return false;
+			while (count--)
+				page_buffer[out++] = in[i++];
+		}
+	}
+	busy(out * DECODE_CYCLES_PER_BYTE / cpu_mhz);
+	return out == page_size;
+}
+
+/**************************************************************************************************
+* Send a character, paced at the current baud rate
+*/
+void put_char(uint8_t byte)
+{
+	if (muted)
+		return;
+	// wait for the data register to empty, then the byte takes one byte time on the wire
+	if (tx_free_us > fw_time_us + byte_time_us())
+		fw_time_us = tx_free_us - byte_time_us();
+	if (tx_free_us < fw_time_us)
+		tx_free_us = fw_time_us;
+	tx_free_us += byte_time_us();
+	sleep_until_us(tx_free_us);
+	if (!tx_mode)
+	{
+		stats.tx_without_de++;		// RS485 driver not enabled
+		return;
+	}
+
+	pthread_mutex_lock(&bus_lock);
+	if ((bus_busy_until_us > tx_free_us - byte_time_us()) && (bus_owner != (int)node_index))
+		collisions++;
+	bus_busy_until_us = tx_free_us;
+	bus_owner = node_index;
+	pthread_mutex_unlock(&bus_lock);
+
+	bus_deliver(node_index, &byte, 1, tx_free_us - byte_time_us(), baud);
+	if (baud_mismatch(host_baud()))
+		byte ^= 0x55;
+	if (write(pty_fd, &byte, 1) != 1)
+		log_msg("write() failed\n");
+	stats.tx_bytes++;
+}
+
+void put_uint16(uint16_t word)
+{
+	put_char(word & 0xFF);
+	put_char((word >> 8) & 0xFF);
+}
+
+void put_uint32(uint32_t word)
+{
+	put_char(word & 0xFF);
+	put_char((word >> 8) & 0xFF);
+	put_char((word >> 16) & 0xFF);
+	put_char((word >> 24) & 0xFF);
+}
+
+/**************************************************************************************************
+* Store a little endian uint32 in a buffer, returns the next position
+*/
+uint8_t *pack_uint32(uint8_t *p, uint32_t word)
+{
+	*p++ = word & 0xFF;
+	*p++ = (word >> 8) & 0xFF;
+	*p++ = (word >> 16) & 0xFF;
+	*p++ = (word >> 24) & 0xFF;
+	return p;
+}
+
+/**************************************************************************************************
+* Send an application section page, returns its CRC16 (XMODEM)
+*/
+uint16_t put_app_page(unsigned int page)
+{
+	uint8_t *data = &flash[page * mcu->app_section_page_size];
+	for (unsigned int i = 0; i < mcu->app_section_page_size; i++)
+		put_char(data[i]);
+	return crc16_xmodem(0, data, mcu->app_section_page_size);
+}
+
+/**************************************************************************************************
+* Firmware busy for a period of time, not reading the USART
+*/
+void busy(uint64_t us)
+{
+	fw_time_us += us;
+	sleep_until_us(fw_time_us);
+}
+
+/**************************************************************************************************
+* RS485 direction switching
+*/
+void ctrl_tx_mode(void)
+{
+	if (muted)
+		return;
+	busy(turnaround_us);
+	tx_mode = true;
+	tx_mode_start_us = fw_time_us;
+}
+
+void ctrl_rx_mode(void)
+{
+	if (muted)
+		return;
+	// TXCIF
+	if (tx_free_us > fw_time_us)
+		fw_time_us = tx_free_us;
+	sleep_until_us(fw_time_us);
+	pthread_mutex_lock(&rxq->lock);
+	apply_overruns(fw_time_us);
+	tx_mode = false;
+	pthread_mutex_unlock(&rxq->lock);
+}
+
+/**************************************************************************************************
+* NVM controller
+*/
+void wait_for_spm(void)
+{
+	if (nvm_busy_until_us > fw_time_us)
+		busy(nvm_busy_until_us - fw_time_us);
+}
+
+void nvm_busy(uint64_t us)
+{
+	nvm_busy_until_us = fw_time_us + us;
+}
+
+// SP_WaitForSPM(), SP_LoadFlashPage() and SP_WriteApplicationPage(), returns without waiting
+void write_app_page(unsigned int page)
+{
+	wait_for_spm();
+	busy((mcu->app_section_page_size / 2) * PAGE_LOAD_CYCLES_PER_WORD / cpu_mhz);
+	if (erase_on_write)
+		memset(&flash[page * mcu->app_section_page_size], 0xFF, mcu->app_section_page_size);
+	for (unsigned int i = 0; i < mcu->app_section_page_size; i++)
+		flash[page * mcu->app_section_page_size + i] &= page_buffer[i];
+	nvm_busy(erase_on_write ? PAGE_ERASE_US + PAGE_WRITE_US : PAGE_WRITE_US);
+	stats.pages_written++;
+}
+
+uint32_t app_crc(void)
+{
+	wait_for_spm();
+	busy((mcu->app_section_size / 1024) * CRC_CYCLES_PER_KB / cpu_mhz);
+	return xmega_nvm_crc32(flash, mcu->app_section_size);
+}
+
+/**************************************************************************************************
+* Emulated bootloader main loop, returns when the MCU resets
+*/
+void bootloader(void)
+{
+	unsigned int app_num_pages = mcu->app_section_size / mcu->app_section_page_size;
+	unsigned int eeprom_num_pages = mcu->eeprom_size / mcu->eeprom_page_size;
+
+	// wait for NOP during the start-up window
+	baud = default_baud;
+	window_naks = 0xFFFFFFFF;
+	muted = false;
+	deselected = false;
+	turnaround_us = TURNAROUND_US;
+	erase_on_write = false;
+	fw_time_us = now_us();
+	tx_free_us = fw_time_us;
+	uint64_t deadline = fw_time_us + BOOTLOADER_WINDOW_US;
+	int c;
+	do
+	{
+		c = get_char_deadline(deadline);
+		if (c < 0)
+		{
+			log_msg("Timeout, starting application\n");
+			return;
+		}
+	} while ((c != CMD_NOP) && (c != CMD_BROADCAST));
+	if (c == CMD_BROADCAST)
+		muted = true;
+	log_msg("Bootloader entered%s\n", muted ? ", muted" : "");
+	ctrl_tx_mode();
+	put_char(RES_OK);
+	ctrl_rx_mode();
+
+	for (;;)
+	{
+		c = get_command();
+		// page writes load the NVM buffer after receiving the page and NOPs pad out windowed frames,
+		// neither should block on the previous write
+		if ((c != CMD_NOP) && (c != CMD_WRITE_PAGE_PIPELINED) && (c != CMD_WRITE_PAGE_FRAMED) &&
+			(c != CMD_WRITE_PAGE_WINDOWED) && (c != CMD_WRITE_PAGE_COMPRESSED))
+			wait_for_spm();
+		switch (c)
+		{
+			case CMD_SET_BAUD:
+			{
+				unsigned int rate;
+				rate = get_char() << 8;
+				rate |= get_char();
+				unsigned int i;
+				for (i = 0; baud_table[i] != 0; i++)
+				{
+					if (baud_table[i] / 100 == rate)
+						break;
+				}
+				ctrl_tx_mode();
+				if (baud_table[i] == 0)
+				{
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				baud = baud_table[i];
+				log_msg("Baud rate %u\n", baud);
+
+				uint64_t deadline = fw_time_us + BAUD_CONFIRM_US;
+				do
+				{
+					c = get_char_deadline(deadline);
+				} while ((c >= 0) && (c != CMD_NOP));
+				if (c != CMD_NOP)
+				{
+					baud = default_baud;
+					log_msg("No confirmation, baud rate %u\n", baud);
+					break;
+				}
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_ERASE_APP_SECTION:
+				wait_for_spm();
+				memset(flash, 0xFF, mcu->app_section_size);
+				nvm_busy(APP_SECTION_ERASE_US);
+				wait_for_spm();		// CPU halted during section erase
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_WRITE_PAGE:
+			case CMD_WRITE_PAGE_PIPELINED:
+			{
+				uint16_t page;
+				page = get_char() << 8;
+				page |= get_char();
+				if (page >= app_num_pages)
+				{
+					ctrl_tx_mode();
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+
+				for (unsigned int i = 0; i < mcu->app_section_page_size; i++)
+					page_buffer[i] = get_char();
+				write_app_page(page);
+				if (c == CMD_WRITE_PAGE)
+					wait_for_spm();
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_WRITE_PAGE_FRAMED:
+			{
+				uint8_t header[2];
+				bool ok = get_page_frame(header, sizeof(header));
+				uint16_t page = (header[0] << 8) | header[1];
+				if (!ok || (page >= app_num_pages))
+				{
+					log_msg("Bad frame\n");
+					ctrl_tx_mode();
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				write_app_page(page);
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_WRITE_PAGE_WINDOWED:
+			{
+				uint8_t header[3];
+				bool ok = get_page_frame(header, sizeof(header));
+				uint16_t page = (header[1] << 8) | header[2];
+				if (!ok || (page >= app_num_pages))
+				{
+					log_msg("Bad frame, seq %u\n", header[0]);
+					break;
+				}
+				write_app_page(page);
+				window_naks &= ~(1UL << (header[0] % WINDOW_MAX_FRAMES));
+				break;
+			}
+
+			case CMD_WINDOW_STATUS:
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_uint32(window_naks);
+				ctrl_rx_mode();
+				window_naks = 0xFFFFFFFF;
+				break;
+
+			case CMD_WRITE_PAGE_COMPRESSED:
+			{
+				uint8_t header[4];
+				for (unsigned int i = 0; i < sizeof(header); i++)
+					header[i] = get_char();
+				uint16_t page = (header[0] << 8) | header[1];
+				uint16_t len = (header[2] << 8) | header[3];
+				if ((len == 0) || (len > mcu->app_section_page_size))
+				{
+					log_msg("Bad compressed frame length %u\n", len);
+					wait_bus_idle();
+					ctrl_tx_mode();
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				uint8_t *data = malloc(len);
+				for (unsigned int i = 0; i < len; i++)
+					data[i] = get_char();
+				uint16_t crc = crc16_xmodem(0, header, sizeof(header));
+				crc = crc16_xmodem(crc, data, len);
+				crc ^= get_char() << 8;
+				crc ^= get_char();
+				bool ok = (crc == 0) && (page < app_num_pages) && decompress_page(data, len);
+				free(data);
+				if (!ok)
+				{
+					log_msg("Bad compressed frame\n");
+					ctrl_tx_mode();
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				write_app_page(page);
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_READ_PAGE:
+			{
+				uint16_t page;
+				page = get_char() << 8;
+				page |= get_char();
+				ctrl_tx_mode();
+				if (page >= app_num_pages)
+				{
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				put_char(RES_OK);
+				put_uint16(mcu->app_section_page_size);
+				put_app_page(page);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_READ_PAGES:
+			{
+				uint16_t page, count;
+				page = get_char() << 8;
+				page |= get_char();
+				count = get_char() << 8;
+				count |= get_char();
+				ctrl_tx_mode();
+				if ((page >= app_num_pages) || (count > app_num_pages - page))
+				{
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				put_char(RES_OK);
+				while (count--)
+					put_uint16(put_app_page(page++));
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_READ_FLASH_CRCS:
+			{
+				uint32_t crc = app_crc();
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_uint32(crc);
+				put_uint32(0x00123456);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_READ_PAGE_CRCS:
+			{
+				uint16_t page, count;
+				page = get_char() << 8;
+				page |= get_char();
+				count = get_char() << 8;
+				count |= get_char();
+				ctrl_tx_mode();
+				if ((page >= app_num_pages) || (count > app_num_pages - page))
+				{
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				put_char(RES_OK);
+				while (count--)
+				{
+					busy(mcu->app_section_page_size * CRC_CYCLES_PER_KB / 1024 / cpu_mhz);
+					uint32_t crc = xmega_nvm_crc32(&flash[page * mcu->app_section_page_size], mcu->app_section_page_size);
+					put_char(crc & 0xFF);
+					put_char((crc >> 8) & 0xFF);
+					put_char((crc >> 16) & 0xFF);
+					page++;
+				}
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_ERASE_PAGE:
+			{
+				uint16_t page;
+				page = get_char() << 8;
+				page |= get_char();
+				ctrl_tx_mode();
+				if (page >= app_num_pages)
+				{
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				memset(&flash[page * mcu->app_section_page_size], 0xFF, mcu->app_section_page_size);
+				nvm_busy(PAGE_ERASE_US);
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_ERASE_ON_WRITE:
+				erase_on_write = get_char();
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_READ_MCU_IDS:
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_uint16(4);
+				put_char(mcu->id[0]);
+				put_char(mcu->id[1]);
+				put_char(mcu->id[2]);
+				put_char(0x01);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_READ_SERIAL:
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_uint16(NODE_SERIAL_LENGTH);
+				for (uint8_t i = 0; i < NODE_SERIAL_LENGTH; i++)
+					put_char(production_sig[i]);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_BROADCAST:
+				muted = true;
+				deselected = false;
+				break;
+
+			case CMD_SELECT_NODE:
+			{
+				bool match = true;
+				for (uint8_t i = 0; i < NODE_SERIAL_LENGTH; i++)
+				{
+					if (get_char() != production_sig[i])
+						match = false;
+				}
+				muted = !match;
+				deselected = !match;
+				if (match)
+					log_msg("Selected\n");
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+			}
+
+			// CPU cycles are not modelled, as a build without BL_CYCLE_STATS
+			case CMD_READ_CYCLE_STATS:
+				ctrl_tx_mode();
+				put_char(RES_FAIL);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_READ_BOOTLOADER_VERSION:
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_char(BOOTLOADER_VERSION);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_RESET_MCU:
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				log_msg("Reset\n");
+				return;
+
+			case CMD_READ_FUSES:
+				ctrl_tx_mode();
+				for (uint8_t i = 0; i < 6; i++)
+					put_char(fuses[i]);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_READ_EEPROM:
+			{
+				uint16_t page;
+				page = get_char() << 8;
+				page |= get_char();
+				ctrl_tx_mode();
+				if (page >= eeprom_num_pages)
+				{
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				put_char(RES_OK);
+				put_uint16(mcu->eeprom_page_size);
+				for (unsigned int i = 0; i < mcu->eeprom_page_size; i++)
+					put_char(eeprom[page * mcu->eeprom_page_size + i]);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_WRITE_EEPROM:
+			{
+				uint16_t page;
+				page = get_char() << 8;
+				page |= get_char();
+				ctrl_tx_mode();
+				if (page >= eeprom_num_pages)
+				{
+					put_char(RES_FAIL);
+					ctrl_rx_mode();
+					break;
+				}
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				for (unsigned int i = 0; i < mcu->eeprom_page_size; i++)
+					eeprom[page * mcu->eeprom_page_size + i] = get_char();
+				busy(EEPROM_WRITE_US);
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_ERASE_USER_SIG_ROW:
+				wait_for_spm();
+				memset(user_sig_row, 0xFF, sizeof(user_sig_row));
+				nvm_busy(PAGE_ERASE_US);
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_READ_USER_SIG_ROW:
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_uint16(mcu->app_section_page_size);
+				for (unsigned int i = 0; i < mcu->app_section_page_size; i++)
+					put_char(user_sig_row[i]);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_WRITE_USER_SIG_ROW:
+				for (unsigned int i = 0; i < mcu->app_section_page_size; i++)
+					page_buffer[i] = get_char();
+				wait_for_spm();
+				for (unsigned int i = 0; i < mcu->app_section_page_size; i++)
+					user_sig_row[i] &= page_buffer[i];
+				nvm_busy(PAGE_WRITE_US);
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_READ_INFO:
+			{
+				uint8_t info[BOOTLOADER_INFO_LENGTH];
+				uint8_t *p = info;
+				*p++ = BOOTLOADER_VERSION;
+				*p++ = mcu->id[0];
+				*p++ = mcu->id[1];
+				*p++ = mcu->id[2];
+				*p++ = 0x01;
+				for (uint8_t i = 0; i < NODE_SERIAL_LENGTH; i++)
+					*p++ = production_sig[i];
+				for (uint8_t i = 0; i < 6; i++)
+					*p++ = fuses[i];
+				p = pack_uint32(p, mcu->app_section_page_size);
+				p = pack_uint32(p, mcu->app_section_size);
+				p = pack_uint32(p, mcu->boot_section_page_size);
+				p = pack_uint32(p, mcu->boot_section_size);
+				p = pack_uint32(p, mcu->eeprom_page_size);
+				pack_uint32(p, mcu->eeprom_size);
+
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_uint16(BOOTLOADER_INFO_LENGTH);
+				for (uint8_t i = 0; i < BOOTLOADER_INFO_LENGTH; i++)
+					put_char(info[i]);
+				put_uint16(crc16_xmodem(0, info, BOOTLOADER_INFO_LENGTH));
+				ctrl_rx_mode();
+				break;
+			}
+
+			case CMD_READ_MEMORY_SIZES:
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				put_uint32(mcu->app_section_page_size);
+				put_uint32(mcu->app_section_size);
+				put_uint32(mcu->boot_section_page_size);
+				put_uint32(mcu->boot_section_size);
+				put_uint32(mcu->eeprom_page_size);
+				put_uint32(mcu->eeprom_size);
+				ctrl_rx_mode();
+				break;
+
+			case CMD_SET_TURNAROUND:
+			{
+				unsigned int us;
+				us = get_char() << 8;
+				us |= get_char();
+				ctrl_tx_mode();
+				put_char(RES_OK);
+				ctrl_rx_mode();
+				turnaround_us = (us / 10 + (us % 10 != 0)) * 10;	// as the firmware rounds it
+				log_msg("Turnaround %u us\n", turnaround_us);
+				break;
+			}
+		}
+	}
+}
+
+/**************************************************************************************************
+* Handle command line args
+*/
+int parse_args(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "m:b:l:e:n:c:q")) != -1)
+	{
+		switch (c)
+		{
+		case 'm':
+			for (mcu = mcu_list; mcu->name != NULL; mcu++)
+			{
+				if (strcmp(mcu->name, optarg) == 0)
+					break;
+			}
+			if (mcu->name == NULL)
+			{
+				printf("Unknown MCU %s.\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'b':
+			baud = default_baud = atoi(optarg);
+			if (baud == 0)
+			{
+				printf("Invalid baud rate.\n");
+				return 1;
+			}
+			break;
+
+		case 'l':
+			latency_us = atoi(optarg);
+			break;
+
+		case 'e':
+			error_interval = atoi(optarg);
+			break;
+
+		case 'n':
+			num_nodes = atoi(optarg);
+			if ((num_nodes < 1) || (num_nodes > MAX_NODES))
+			{
+				printf("1 to %d nodes.\n", MAX_NODES);
+				return 1;
+			}
+			break;
+
+		case 'c':
+			cpu_mhz = atoi(optarg);
+			if ((cpu_mhz < 1) || (cpu_mhz > 32))
+			{
+				printf("CPU clock must be 1 to 32 MHz.\n");
+				return 1;
+			}
+			break;
+
+		case 'q':
+			opt_quiet = true;
+			break;
+
+		default:
+			printf("Usage: sboot_emu [-m mcu] [-b baud] [-l latency] [-e interval] [-n nodes] [-c MHz] [-q]\n");
+			printf("Options: -m    MCU type (64a1u, 128a1u, 256a3u)\n");
+			printf("         -b    Initial baud rate (default 19200)\n");
+			printf("         -l    USB adapter latency in microseconds (default %u)\n", DEFAULT_LATENCY_US);
+			printf("         -e    Corrupt one in every <interval> received bytes\n");
+			printf("         -n    Number of RS485 nodes sharing the port, serial numbers end in 00, 01, ...\n");
+			printf("         -c    CPU clock in MHz for CPU bound work (default %u)\n", DEFAULT_CPU_MHZ);
+			printf("         -q    Quiet\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**************************************************************************************************
+* One node on the bus
+*/
+void *node_thread(void *arg)
+{
+	node_index = (unsigned int)(uintptr_t)arg;
+	rxq = &rx_queues[node_index];
+	production_sig[NODE_SERIAL_LENGTH - 1] = node_index;
+	baud = default_baud;
+
+	flash = malloc(mcu->app_section_size);
+	eeprom = malloc(mcu->eeprom_size);
+	page_buffer = malloc(mcu->app_section_page_size);
+	if ((flash == NULL) || (eeprom == NULL) || (page_buffer == NULL))
+	{
+		printf("Out of memory.\n");
+		exit(1);
+	}
+	memset(flash, 0xFF, mcu->app_section_size);
+	memset(eeprom, 0xFF, mcu->eeprom_size);
+	memset(user_sig_row, 0xFF, sizeof(user_sig_row));
+
+	for (;;)
+	{
+		bootloader();
+		log_msg("Stats: rx %lu, tx %lu, overruns %lu, lost in TX mode %lu, sent in RX mode %lu, pages written %lu, baud errors %lu, injected errors %lu, collisions %lu\n",
+				stats.rx_bytes, stats.tx_bytes, stats.overruns, stats.rx_while_tx, stats.tx_without_de, stats.pages_written, stats.baud_errors, injected_errors, collisions);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	if (parse_args(argc, argv) != 0)
+		return 1;
+
+	pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((pty_fd < 0) || (grantpt(pty_fd) != 0) || (unlockpt(pty_fd) != 0))
+	{
+		perror("posix_openpt");
+		return 1;
+	}
+	struct termios tio;
+	tcgetattr(pty_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(pty_fd, TCSANOW, &tio);
+
+	// keep the slave open so reads don't fail while no host is connected
+	int slave_fd = open(ptsname(pty_fd), O_RDWR | O_NOCTTY);
+	if (slave_fd < 0)
+	{
+		perror("open");
+		return 1;
+	}
+	tcgetattr(slave_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+
+	printf("%s\n", ptsname(pty_fd));
+	fflush(stdout);
+	log_msg("Emulating %u ATxmega%s at %u MHz, %u baud\n", num_nodes, mcu->name, cpu_mhz, baud);
+
+	pthread_t nodes[MAX_NODES];
+	for (unsigned int i = 0; i < num_nodes; i++)
+	{
+		pthread_mutex_init(&rx_queues[i].lock, NULL);
+		pthread_cond_init(&rx_queues[i].cond, NULL);
+		pthread_create(&nodes[i], NULL, node_thread, (void *)(uintptr_t)i);
+	}
+	reader_thread(NULL);
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+// bench.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "intel_hex.h"
+#include "hex_decode.h"
+#include "compress.h"
+#include "crc.h"
+#include "bootloader.h"
+#include "timing.h"
+#include "bench.h"
+
+
+#define	DECODE_CYCLES_PER_BYTE		8		// decompress_page() inner loops, avr-gcc -Os
+#define	FRAMED_OVERHEAD				5		// CMD_WRITE_PAGE_FRAMED command, page number and CRC16
+#define	COMPRESSED_OVERHEAD			7		// CMD_WRITE_PAGE_COMPRESSED also has the length
+#define	HEX_BENCH_US				500000	// minimum time parsing with each kernel
+#define	CRC_BENCH_US				500000	// minimum time for each CRC implementation
+
+
+/**************************************************************************************************
+* Time repeated parses for at least HEX_BENCH_US, returns MB/s or 0 if the file doesn't parse
+*/
+static double HexParseRate(MAPPED_FILE_t *file, int threads)
+{
+	long runs = 0;
+	uint64_t start = TimeUs();
+	uint64_t elapsed;
+	do
+	{
+		if (!ParseHexParallel(file->data, file->size, threads))
+			return 0;
+		runs++;
+		elapsed = TimeUs() - start;
+	} while (elapsed < HEX_BENCH_US);
+	return ((double)file->size * runs) / elapsed;
+}
+
+/**************************************************************************************************
+* Parse the hex file repeatedly with each decode kernel the CPU supports, then with the fastest one
+* on more threads, and report the throughput. The file is mapped once, so only parsing into the
+* image buffer is timed.
+*/
+void BenchHexParse(char *filename)
+{
+	MAPPED_FILE_t file;
+	if (!MapFile(filename, &file))
+	{
+		printf("Unable to open %s.\n", filename);
+		return;
+	}
+
+	printf("Hex parse benchmark, %.2f MB\n", file.size / 1000000.0);
+	for (int kernel = 0; kernel < NUM_HEX_KERNELS; kernel++)
+	{
+		if (!SelectHexKernel((HEX_KERNEL_t)kernel))
+			continue;
+		double rate = HexParseRate(&file, 1);
+		if (rate == 0)
+			goto exit;
+		printf("%s:\t\t%.1f MB/s\n", hex_kernel_names[kernel], rate);
+	}
+
+	// files under MIN_PARSE_CHUNK per thread use fewer threads
+	SelectBestHexKernel();
+	int cpus = CpuCount();
+	for (int threads = 2; threads < cpus * 2; threads *= 2)
+	{
+		if (threads > cpus)
+			threads = cpus;
+		printf("%d threads:\t%.1f MB/s\n", threads, HexParseRate(&file, threads));
+	}
+	printf("\n");
+
+exit:
+	SelectBestHexKernel();
+	UnmapFile(&file);
+}
+
+/**************************************************************************************************
+* Time repeated NVM CRCs of the whole flash image for at least CRC_BENCH_US, returns MB/s
+*/
+static double NvmCrcRate(uint32_t (*crc_func)(uint8_t *, uint32_t), uint32_t size, uint32_t *crc)
+{
+	long runs = 0;
+	uint64_t start = TimeUs();
+	uint64_t elapsed;
+	do
+	{
+		*crc = crc_func(firmware_buffer, size);
+		runs++;
+		elapsed = TimeUs() - start;
+	} while (elapsed < CRC_BENCH_US);
+	return ((double)size * runs) / elapsed;
+}
+
+// as ReadHexFile() does it, skipping blank blocks
+static uint32_t SparseNvmCrc(uint8_t *buffer, uint32_t size)
+{
+	(void)buffer;
+	return ImageNvmCrc(size);
+}
+
+/**************************************************************************************************
+* Check that CRCs built from the image's per-page CRCs, and updated after changing a page, match
+* CRCing the whole image
+*/
+static bool CheckNvmCrcCombine(uint32_t size, uint32_t image_crc)
+{
+	uint32_t page_size = fw_info->page_size_b;
+	uint32_t crc = 0;
+	for (uint32_t addr = 0; addr < size; addr += page_size)
+		crc = xmega_nvm_crc32_combine(crc, xmega_nvm_crc32(&firmware_buffer[addr], page_size), page_size);
+	if (crc != image_crc)
+	{
+		printf("Combined page CRCs 0x%06X, expected 0x%06X.\n", crc, image_crc);
+		return false;
+	}
+
+	// temporarily invert a page in the middle
+	uint8_t *page = &firmware_buffer[(size / page_size / 2) * page_size];
+	uint32_t old_crc = xmega_nvm_crc32(page, page_size);
+	for (uint32_t i = 0; i < page_size; i++)
+		page[i] ^= 0xFF;
+	uint32_t new_crc = xmega_nvm_crc32(page, page_size);
+	uint32_t expected = xmega_nvm_crc32(firmware_buffer, size);
+	for (uint32_t i = 0; i < page_size; i++)
+		page[i] ^= 0xFF;
+	crc = xmega_nvm_crc32_update(image_crc, old_crc, new_crc, (uint32_t)(&firmware_buffer[size] - &page[page_size]));
+	if (crc != expected)
+	{
+		printf("Updated CRC 0x%06X, expected 0x%06X.\n", crc, expected);
+		return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Check the table driven NVM CRC against the bitwise reference over the loaded image, and over
+* every shorter length up to a few steps, then report the throughput of both and of the CRC that
+* skips blank blocks. The CRC combining functions are checked too.
+*/
+void BenchNvmCrc(void)
+{
+	uint32_t size = fw_info->flash_size_b;
+	for (uint32_t len = 0; len <= 256; len += 2)
+	{
+		if (xmega_nvm_crc32(firmware_buffer, len) != xmega_nvm_crc32_bitwise(firmware_buffer, len))
+		{
+			printf("NVM CRC mismatch over %u bytes.\n", len);
+			return;
+		}
+	}
+
+	uint32_t bitwise_crc, table_crc, sparse_crc;
+	printf("NVM CRC benchmark, %u KB\n", size / 1024);
+	double bitwise_rate = NvmCrcRate(xmega_nvm_crc32_bitwise, size, &bitwise_crc);
+	double table_rate = NvmCrcRate(xmega_nvm_crc32, size, &table_crc);
+	double sparse_rate = NvmCrcRate(SparseNvmCrc, size, &sparse_crc);
+	if ((table_crc != bitwise_crc) || (sparse_crc != bitwise_crc))
+	{
+		printf("NVM CRC mismatch: table 0x%06X, sparse 0x%06X, reference 0x%06X.\n", table_crc, sparse_crc, bitwise_crc);
+		return;
+	}
+	if (!CheckNvmCrcCombine(size, bitwise_crc))
+		return;
+	printf("bitwise:\t%.1f MB/s\n", bitwise_rate);
+	printf("table:\t\t%.1f MB/s (%.1fx)\n", table_rate, table_rate / bitwise_rate);
+	printf("sparse:\t\t%.1f MB/s (%.1fx)\n", sparse_rate, sparse_rate / bitwise_rate);
+	printf("\n");
+}
+
+/**************************************************************************************************
+* Compress every populated page of the loaded image as sboot -z would, check that it decodes
+* back to the original, and report the size and estimated time saved at a given baud rate.
+*/
+void BenchCompression(int baud)
+{
+	int page_size = fw_info->page_size_b;
+	int num_pages = fw_info->flash_size_b / page_size;
+	uint8_t *compressed = malloc(page_size);
+	uint8_t *decoded = malloc(page_size);
+	if ((compressed == NULL) || (decoded == NULL))
+	{
+		printf("Out of memory.\n");
+		goto exit;
+	}
+
+	long raw_bytes = 0;
+	long sent_bytes = 0;
+	long decoded_bytes = 0;
+	int pages = 0;
+	int compressed_pages = 0;
+	clock_t start = clock();
+
+	for (int page = 0; page < num_pages; page++)
+	{
+		if (!PagePopulated(page, page_size))
+			continue;
+		pages++;
+		raw_bytes += FRAMED_OVERHEAD + page_size;
+
+		uint8_t *data = &firmware_buffer[page * page_size];
+		int len = CompressPage(data, page_size, compressed, page_size - 1);
+		if (len < 0)
+		{
+			sent_bytes += FRAMED_OVERHEAD + page_size;		// sent uncompressed
+			continue;
+		}
+		compressed_pages++;
+		sent_bytes += COMPRESSED_OVERHEAD + len;
+		decoded_bytes += page_size;
+
+		if (!DecompressPage(compressed, len, decoded, page_size) ||
+			(memcmp(decoded, data, page_size) != 0))
+		{
+			printf("Page %d does not decompress correctly.\n", page);
+			goto exit;
+		}
+	}
+
+	double host_s = (double)(clock() - start) / CLOCKS_PER_SEC;
+	if (pages == 0)
+	{
+		printf("Image is empty.\n");
+		goto exit;
+	}
+
+	double raw_s = (raw_bytes * 10.0) / baud;		// 8N1
+	double sent_s = (sent_bytes * 10.0) / baud;
+	double decode_s = ((double)decoded_bytes * DECODE_CYCLES_PER_BYTE) / BOOTLOADER_F_CPU;
+	double saved_s = raw_s - sent_s - decode_s;
+
+	printf("Compression benchmark, %d pages of %d bytes at %d baud\n", pages, page_size, baud);
+	printf("Compressed pages:\t%d (others sent uncompressed)\n", compressed_pages);
+	printf("Uncompressed:\t%ld bytes, %.2f s on the wire\n", raw_bytes, raw_s);
+	printf("Compressed:\t%ld bytes (%.1f%%), %.2f s on the wire\n", sent_bytes, (sent_bytes * 100.0) / raw_bytes, sent_s);
+	printf("Device decode:\t%.2f s estimated at %d MHz\n", decode_s, BOOTLOADER_F_CPU / 1000000);
+	printf("Net saving:\t%.2f s (%.1f%%)\n", saved_s, (saved_s * 100.0) / raw_s);
+	printf("Host compress:\t%.1f ms\n", host_s * 1000.0);
+
+exit:
+	free(compressed);
+	free(decoded);
+}
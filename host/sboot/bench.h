@@ -0,0 +1,12 @@
+// bench.h
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+
+extern void BenchHexParse(char *filename);
+extern void BenchNvmCrc(void);
+extern void BenchCompression(int baud);
+
+
+#endif
@@ -0,0 +1,126 @@
+// compress.c
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "compress.h"
+#include "bootloader.h"
+
+
+/**************************************************************************************************
+* Find the longest match for the data at pos earlier in the page. Returns the length, or 0 if
+* shorter than LZ_MIN_MATCH.
+*/
+static int FindMatch(const uint8_t *page, int page_size, int pos, int *distance)
+{
+	int best_len = 0;
+	int max_len = page_size - pos;
+	if (max_len > LZ_MAX_MATCH)
+		max_len = LZ_MAX_MATCH;
+
+	for (int start = pos - 1; start >= 0; start--)
+	{
+		int len = 0;
+		while ((len < max_len) && (page[start + len] == page[pos + len]))	// may overlap pos
+			len++;
+		if (len > best_len)
+		{
+			best_len = len;
+			*distance = pos - start;
+			if (len == max_len)
+				break;
+		}
+	}
+
+	if (best_len < LZ_MIN_MATCH)
+		return 0;
+	return best_len;
+}
+
+/**************************************************************************************************
+* Greedy LZ compression of one page in the format decoded by the bootloader. Returns the
+* compressed length, or -1 if the result would not fit in out_size bytes.
+*/
+int CompressPage(const uint8_t *page, int page_size, uint8_t *out, int out_size)
+{
+	int in = 0;
+	int len = 0;
+	int literal_token = -1;		// index of the current literal run's token in out
+
+	while (in < page_size)
+	{
+		int distance;
+		int match = FindMatch(page, page_size, in, &distance);
+		if ((match == LZ_MIN_MATCH) && (literal_token >= 0))
+			match = 0;		// no smaller than extending the literal run
+		if (match)
+		{
+			if (len + 3 > out_size)
+				return -1;
+			out[len++] = LZ_MATCH_FLAG | (match - LZ_MIN_MATCH);
+			out[len++] = (distance >> 8) & 0xFF;
+			out[len++] = distance & 0xFF;
+			in += match;
+			literal_token = -1;
+			continue;
+		}
+
+		// extend the current literal run or start a new one
+		if ((literal_token < 0) || (out[literal_token] == LZ_MAX_LITERALS - 1))
+		{
+			if (len + 2 > out_size)
+				return -1;
+			literal_token = len;
+			out[len++] = 0;
+		}
+		else
+		{
+			if (len + 1 > out_size)
+				return -1;
+			out[literal_token]++;
+		}
+		out[len++] = page[in++];
+	}
+
+	return len;
+}
+
+/**************************************************************************************************
+* Reference decoder, mirrors decompress_page() in the bootloader
+*/
+bool DecompressPage(const uint8_t *in, int len, uint8_t *page, int page_size)
+{
+	int i = 0;
+	int out = 0;
+
+	while (i < len)
+	{
+		uint8_t token = in[i++];
+		int count;
+		if (token & LZ_MATCH_FLAG)
+		{
+			if (len - i < 2)
+				return false;
+			int distance = (in[i] << 8) | in[i + 1];
+			i += 2;
+			count = (token & ~LZ_MATCH_FLAG) + LZ_MIN_MATCH;
+			if ((distance == 0) || (distance > out) || (count > page_size - out))
+				return false;
+			while (count--)
+			{
+				page[out] = page[out - distance];
+				out++;
+			}
+		}
+		else
+		{
+			count = token + 1;
+			if ((count > len - i) || (count > page_size - out))
+				return false;
+			memcpy(&page[out], &in[i], count);
+			i += count;
+			out += count;
+		}
+	}
+	return out == page_size;
+}
@@ -0,0 +1,11 @@
+// compress.h
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+
+extern int CompressPage(const uint8_t *page, int page_size, uint8_t *out, int out_size);
+extern bool DecompressPage(const uint8_t *in, int len, uint8_t *page, int page_size);
+
+
+#endif
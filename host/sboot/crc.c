@@ -109,11 +109,31 @@ uint32_t crc32(uint8_t *buffer, uint32_t buffer_length)
 */
 
 /**************************************************************************************************
-* XMEGA NVM compatible CRC32
+* CRC16 XMODEM, same as avr-libc _crc_xmodem_update(). Pass 0 as the initial crc.
+*/
+uint16_t crc16_xmodem(uint16_t crc, uint8_t *buffer, uint32_t buffer_length)
+{
+	for (uint32_t i = 0; i < buffer_length; i++)
+	{
+		crc ^= (uint16_t)buffer[i] << 8;
+		for (int j = 0; j < 8; j++)
+		{
+			if (crc & 0x8000)
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc <<= 1;
+		}
+	}
+	return crc;
+}
+
+/**************************************************************************************************
+* XMEGA NVM compatible CRC32, one word at a time as the NVM controller does it. This is the
+* reference for xmega_nvm_crc32().
 */
 #define XMEGA_CRC32_POLY	0x0080001B	// Polynomial for use with Xmega devices
 
-uint32_t xmega_nvm_crc32(uint8_t *buffer, uint32_t buffer_length)
+uint32_t xmega_nvm_crc32_bitwise(uint8_t *buffer, uint32_t buffer_length)
 {
 	uint32_t	address;
 	uint32_t	data_reg, help_a, help_b;
@@ -135,4 +155,198 @@ uint32_t xmega_nvm_crc32(uint8_t *buffer, uint32_t buffer_length)
 	}
 
 	return crc_reg;
-}
\ No newline at end of file
+}
+
+/**************************************************************************************************
+* Table driven XMEGA NVM CRC, 16 words per step.
+*
+* Each word shifts the 24 bit register left with feedback from the polynomial and is then XORed in,
+* which is multiplying by x modulo P(x) = x^24 + x^23 + x^4 + x^3 + x + 1. After 16 words the
+* register is crc * x^16 + sum(word[i] * x^(15 - i)). The word terms are just shifts, so only the
+* bits that land above bit 23 need reducing, a byte at a time using these tables of b * x^24 and
+* b * x^32 mod P(x). They were generated by stepping xmega_nvm_crc32_bitwise().
+*/
+static const uint32_t xmega_crc_table[2][256] = {
+	{	// b * x^24
+		0x000000, 0x80001B, 0x80002D, 0x000036, 0x800041, 0x00005A, 0x00006C, 0x800077,
+		0x800099, 0x000082, 0x0000B4, 0x8000AF, 0x0000D8, 0x8000C3, 0x8000F5, 0x0000EE,
+		0x800129, 0x000132, 0x000104, 0x80011F, 0x000168, 0x800173, 0x800145, 0x00015E,
+		0x0001B0, 0x8001AB, 0x80019D, 0x000186, 0x8001F1, 0x0001EA, 0x0001DC, 0x8001C7,
+		0x800249, 0x000252, 0x000264, 0x80027F, 0x000208, 0x800213, 0x800225, 0x00023E,
+		0x0002D0, 0x8002CB, 0x8002FD, 0x0002E6, 0x800291, 0x00028A, 0x0002BC, 0x8002A7,
+		0x000360, 0x80037B, 0x80034D, 0x000356, 0x800321, 0x00033A, 0x00030C, 0x800317,
+		0x8003F9, 0x0003E2, 0x0003D4, 0x8003CF, 0x0003B8, 0x8003A3, 0x800395, 0x00038E,
+		0x800489, 0x000492, 0x0004A4, 0x8004BF, 0x0004C8, 0x8004D3, 0x8004E5, 0x0004FE,
+		0x000410, 0x80040B, 0x80043D, 0x000426, 0x800451, 0x00044A, 0x00047C, 0x800467,
+		0x0005A0, 0x8005BB, 0x80058D, 0x000596, 0x8005E1, 0x0005FA, 0x0005CC, 0x8005D7,
+		0x800539, 0x000522, 0x000514, 0x80050F, 0x000578, 0x800563, 0x800555, 0x00054E,
+		0x0006C0, 0x8006DB, 0x8006ED, 0x0006F6, 0x800681, 0x00069A, 0x0006AC, 0x8006B7,
+		0x800659, 0x000642, 0x000674, 0x80066F, 0x000618, 0x800603, 0x800635, 0x00062E,
+		0x8007E9, 0x0007F2, 0x0007C4, 0x8007DF, 0x0007A8, 0x8007B3, 0x800785, 0x00079E,
+		0x000770, 0x80076B, 0x80075D, 0x000746, 0x800731, 0x00072A, 0x00071C, 0x800707,
+		0x800909, 0x000912, 0x000924, 0x80093F, 0x000948, 0x800953, 0x800965, 0x00097E,
+		0x000990, 0x80098B, 0x8009BD, 0x0009A6, 0x8009D1, 0x0009CA, 0x0009FC, 0x8009E7,
+		0x000820, 0x80083B, 0x80080D, 0x000816, 0x800861, 0x00087A, 0x00084C, 0x800857,
+		0x8008B9, 0x0008A2, 0x000894, 0x80088F, 0x0008F8, 0x8008E3, 0x8008D5, 0x0008CE,
+		0x000B40, 0x800B5B, 0x800B6D, 0x000B76, 0x800B01, 0x000B1A, 0x000B2C, 0x800B37,
+		0x800BD9, 0x000BC2, 0x000BF4, 0x800BEF, 0x000B98, 0x800B83, 0x800BB5, 0x000BAE,
+		0x800A69, 0x000A72, 0x000A44, 0x800A5F, 0x000A28, 0x800A33, 0x800A05, 0x000A1E,
+		0x000AF0, 0x800AEB, 0x800ADD, 0x000AC6, 0x800AB1, 0x000AAA, 0x000A9C, 0x800A87,
+		0x000D80, 0x800D9B, 0x800DAD, 0x000DB6, 0x800DC1, 0x000DDA, 0x000DEC, 0x800DF7,
+		0x800D19, 0x000D02, 0x000D34, 0x800D2F, 0x000D58, 0x800D43, 0x800D75, 0x000D6E,
+		0x800CA9, 0x000CB2, 0x000C84, 0x800C9F, 0x000CE8, 0x800CF3, 0x800CC5, 0x000CDE,
+		0x000C30, 0x800C2B, 0x800C1D, 0x000C06, 0x800C71, 0x000C6A, 0x000C5C, 0x800C47,
+		0x800FC9, 0x000FD2, 0x000FE4, 0x800FFF, 0x000F88, 0x800F93, 0x800FA5, 0x000FBE,
+		0x000F50, 0x800F4B, 0x800F7D, 0x000F66, 0x800F11, 0x000F0A, 0x000F3C, 0x800F27,
+		0x000EE0, 0x800EFB, 0x800ECD, 0x000ED6, 0x800EA1, 0x000EBA, 0x000E8C, 0x800E97,
+		0x800E79, 0x000E62, 0x000E54, 0x800E4F, 0x000E38, 0x800E23, 0x800E15, 0x000E0E
+	},
+	{	// b * x^32
+		0x000000, 0x801209, 0x802409, 0x003600, 0x804809, 0x005A00, 0x006C00, 0x807E09,
+		0x809009, 0x008200, 0x00B400, 0x80A609, 0x00D800, 0x80CA09, 0x80FC09, 0x00EE00,
+		0x812009, 0x013200, 0x010400, 0x811609, 0x016800, 0x817A09, 0x814C09, 0x015E00,
+		0x01B000, 0x81A209, 0x819409, 0x018600, 0x81F809, 0x01EA00, 0x01DC00, 0x81CE09,
+		0x824009, 0x025200, 0x026400, 0x827609, 0x020800, 0x821A09, 0x822C09, 0x023E00,
+		0x02D000, 0x82C209, 0x82F409, 0x02E600, 0x829809, 0x028A00, 0x02BC00, 0x82AE09,
+		0x036000, 0x837209, 0x834409, 0x035600, 0x832809, 0x033A00, 0x030C00, 0x831E09,
+		0x83F009, 0x03E200, 0x03D400, 0x83C609, 0x03B800, 0x83AA09, 0x839C09, 0x038E00,
+		0x848009, 0x049200, 0x04A400, 0x84B609, 0x04C800, 0x84DA09, 0x84EC09, 0x04FE00,
+		0x041000, 0x840209, 0x843409, 0x042600, 0x845809, 0x044A00, 0x047C00, 0x846E09,
+		0x05A000, 0x85B209, 0x858409, 0x059600, 0x85E809, 0x05FA00, 0x05CC00, 0x85DE09,
+		0x853009, 0x052200, 0x051400, 0x850609, 0x057800, 0x856A09, 0x855C09, 0x054E00,
+		0x06C000, 0x86D209, 0x86E409, 0x06F600, 0x868809, 0x069A00, 0x06AC00, 0x86BE09,
+		0x865009, 0x064200, 0x067400, 0x866609, 0x061800, 0x860A09, 0x863C09, 0x062E00,
+		0x87E009, 0x07F200, 0x07C400, 0x87D609, 0x07A800, 0x87BA09, 0x878C09, 0x079E00,
+		0x077000, 0x876209, 0x875409, 0x074600, 0x873809, 0x072A00, 0x071C00, 0x870E09,
+		0x890009, 0x091200, 0x092400, 0x893609, 0x094800, 0x895A09, 0x896C09, 0x097E00,
+		0x099000, 0x898209, 0x89B409, 0x09A600, 0x89D809, 0x09CA00, 0x09FC00, 0x89EE09,
+		0x082000, 0x883209, 0x880409, 0x081600, 0x886809, 0x087A00, 0x084C00, 0x885E09,
+		0x88B009, 0x08A200, 0x089400, 0x888609, 0x08F800, 0x88EA09, 0x88DC09, 0x08CE00,
+		0x0B4000, 0x8B5209, 0x8B6409, 0x0B7600, 0x8B0809, 0x0B1A00, 0x0B2C00, 0x8B3E09,
+		0x8BD009, 0x0BC200, 0x0BF400, 0x8BE609, 0x0B9800, 0x8B8A09, 0x8BBC09, 0x0BAE00,
+		0x8A6009, 0x0A7200, 0x0A4400, 0x8A5609, 0x0A2800, 0x8A3A09, 0x8A0C09, 0x0A1E00,
+		0x0AF000, 0x8AE209, 0x8AD409, 0x0AC600, 0x8AB809, 0x0AAA00, 0x0A9C00, 0x8A8E09,
+		0x0D8000, 0x8D9209, 0x8DA409, 0x0DB600, 0x8DC809, 0x0DDA00, 0x0DEC00, 0x8DFE09,
+		0x8D1009, 0x0D0200, 0x0D3400, 0x8D2609, 0x0D5800, 0x8D4A09, 0x8D7C09, 0x0D6E00,
+		0x8CA009, 0x0CB200, 0x0C8400, 0x8C9609, 0x0CE800, 0x8CFA09, 0x8CCC09, 0x0CDE00,
+		0x0C3000, 0x8C2209, 0x8C1409, 0x0C0600, 0x8C7809, 0x0C6A00, 0x0C5C00, 0x8C4E09,
+		0x8FC009, 0x0FD200, 0x0FE400, 0x8FF609, 0x0F8800, 0x8F9A09, 0x8FAC09, 0x0FBE00,
+		0x0F5000, 0x8F4209, 0x8F7409, 0x0F6600, 0x8F1809, 0x0F0A00, 0x0F3C00, 0x8F2E09,
+		0x0EE000, 0x8EF209, 0x8EC409, 0x0ED600, 0x8EA809, 0x0EBA00, 0x0E8C00, 0x8E9E09,
+		0x8E7009, 0x0E6200, 0x0E5400, 0x8E4609, 0x0E3800, 0x8E2A09, 0x8E1C09, 0x0E0E00
+	}
+};
+
+#define	NVM_WORD(p, i)		((uint32_t)((p)[(i) * 2] | ((p)[(i) * 2 + 1] << 8)))
+
+uint32_t xmega_nvm_crc32(uint8_t *buffer, uint32_t buffer_length)
+{
+	uint32_t	address = 0;
+	uint32_t	crc_reg = 0;
+
+	for (; address + 32 <= buffer_length; address += 32)
+	{
+		uint8_t *p = &buffer[address];
+
+		// two independent halves, the first reaches bit 30
+		uint32_t hi = (NVM_WORD(p, 0) << 15) ^ (NVM_WORD(p, 1) << 14) ^ (NVM_WORD(p, 2) << 13) ^ (NVM_WORD(p, 3) << 12) ^
+					  (NVM_WORD(p, 4) << 11) ^ (NVM_WORD(p, 5) << 10) ^ (NVM_WORD(p, 6) << 9) ^ (NVM_WORD(p, 7) << 8);
+		uint32_t lo = (NVM_WORD(p, 8) << 7) ^ (NVM_WORD(p, 9) << 6) ^ (NVM_WORD(p, 10) << 5) ^ (NVM_WORD(p, 11) << 4) ^
+					  (NVM_WORD(p, 12) << 3) ^ (NVM_WORD(p, 13) << 2) ^ (NVM_WORD(p, 14) << 1) ^ NVM_WORD(p, 15);
+
+		// bits 24 to 39 of (crc_reg << 16) ^ hi ^ lo
+		uint32_t over = (crc_reg >> 8) ^ (hi >> 24);
+		crc_reg = (((crc_reg << 16) ^ hi ^ lo) & 0x00FFFFFF) ^ xmega_crc_table[0][over & 0xFF] ^ xmega_crc_table[1][over >> 8];
+	}
+
+	// remaining words one at a time
+	for (; address < buffer_length; address += 2)
+	{
+		uint32_t feedback = (crc_reg & (1 << 23)) ? XMEGA_CRC32_POLY : 0;
+		crc_reg = (((crc_reg << 1) & 0x00FFFFFE) ^ NVM_WORD(buffer, address / 2) ^ feedback) & 0x00FFFFFF;
+	}
+
+	return crc_reg;
+}
+
+/**************************************************************************************************
+* Arithmetic on XMEGA NVM CRCs. The register starts at zero and each word multiplies it by x modulo
+* P(x) before being XORed in, so the CRC of a buffer is just its words as a polynomial mod P(x).
+* CRCs of separate regions therefore combine with a multiply by a power of x, which takes time
+* logarithmic in the length. Lengths are in bytes and must be even, like the buffers the NVM
+* controller checks.
+*/
+static uint32_t nvm_crc_times_x(uint32_t crc)
+{
+	return ((crc << 1) & 0x00FFFFFE) ^ ((crc & (1 << 23)) ? XMEGA_CRC32_POLY : 0);
+}
+
+// a * b mod P(x)
+static uint32_t nvm_crc_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+	for (int bit = 23; bit >= 0; bit--)
+	{
+		product = nvm_crc_times_x(product);
+		if (b & ((uint32_t)1 << bit))
+			product ^= a;
+	}
+	return product;
+}
+
+// x^n mod P(x)
+static uint32_t nvm_crc_x_power(uint32_t n)
+{
+	uint32_t power = 1;
+	uint32_t square = 2;		// x
+	for (; n > 0; n >>= 1)
+	{
+		if (n & 1)
+			power = nvm_crc_multiply(power, square);
+		square = nvm_crc_multiply(square, square);
+	}
+	return power;
+}
+
+// CRC after length more bytes of zeros
+uint32_t xmega_nvm_crc32_shift(uint32_t crc, uint32_t length)
+{
+	return nvm_crc_multiply(crc, nvm_crc_x_power(length / 2));
+}
+
+// CRC of region A followed by region B, from their separate CRCs
+uint32_t xmega_nvm_crc32_combine(uint32_t crc_a, uint32_t crc_b, uint32_t length_b)
+{
+	return xmega_nvm_crc32_shift(crc_a, length_b) ^ crc_b;
+}
+
+// CRC after length more bytes of value, e.g. 0xFF for erased flash
+uint32_t xmega_nvm_crc32_fill(uint32_t crc, uint8_t value, uint32_t length)
+{
+	// the run's own CRC is word * (x^(n-1) + ... + x + 1), built up a bit of n at a time from the top
+	uint32_t word = value | (value << 8);
+	uint32_t n = length / 2;
+	uint32_t run_crc = 0;
+	uint32_t power = 1;			// x^k for the k words so far
+	int top = 31;
+	while ((top >= 0) && !(n & ((uint32_t)1 << top)))
+		top--;
+	for (int bit = top; bit >= 0; bit--)
+	{
+		run_crc = nvm_crc_multiply(run_crc, power) ^ run_crc;		// k to 2k words
+		power = nvm_crc_multiply(power, power);
+		if (n & ((uint32_t)1 << bit))
+		{
+			run_crc = nvm_crc_times_x(run_crc) ^ word;				// one more
+			power = nvm_crc_times_x(power);
+		}
+	}
+	return nvm_crc_multiply(crc, power) ^ run_crc;
+}
+
+// CRC of a buffer after a region of it changes, given the region's old and new CRCs and how many
+// bytes of the buffer follow it
+uint32_t xmega_nvm_crc32_update(uint32_t crc, uint32_t old_region_crc, uint32_t new_region_crc, uint32_t length_after)
+{
+	return crc ^ xmega_nvm_crc32_shift(old_region_crc ^ new_region_crc, length_after);
+}
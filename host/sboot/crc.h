@@ -1,4 +1,10 @@
 // crc.h
 
 extern uint32_t crc32(uint8_t *buffer, uint32_t buffer_length);
+extern uint16_t crc16_xmodem(uint16_t crc, uint8_t *buffer, uint32_t buffer_length);
 extern uint32_t xmega_nvm_crc32(uint8_t *buffer, uint32_t buffer_length);
+extern uint32_t xmega_nvm_crc32_bitwise(uint8_t *buffer, uint32_t buffer_length);
+extern uint32_t xmega_nvm_crc32_shift(uint32_t crc, uint32_t length);
+extern uint32_t xmega_nvm_crc32_combine(uint32_t crc_a, uint32_t crc_b, uint32_t length_b);
+extern uint32_t xmega_nvm_crc32_fill(uint32_t crc, uint8_t value, uint32_t length);
+extern uint32_t xmega_nvm_crc32_update(uint32_t crc, uint32_t old_region_crc, uint32_t new_region_crc, uint32_t length_after);
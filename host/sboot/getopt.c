@@ -1169,6 +1169,16 @@ const char *optstring;
 	return _getopt_internal(argc, argv, optstring,
 							(const struct option *) 0, (int *) 0, 0);
 }
+int getopt_long(argc, argv, options, long_options, opt_index)
+int argc;
+char *const *argv;
+const char *options;
+const struct option *long_options;
+int *opt_index;
+
+{
+	return _getopt_internal(argc, argv, options, long_options, opt_index, 0);
+}
 #endif							/* Not ELIDE_CODE. */
 
 /* Compile with -DTEST to make an executable for use in testing the above
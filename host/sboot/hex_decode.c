@@ -0,0 +1,226 @@
+// hex_decode.c
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "hex_decode.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define	HEX_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define	HEX_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define	TARGET_AVX2
+#else
+#define	TARGET_AVX2		__attribute__((target("avx2")))
+#endif
+#endif
+#endif
+
+
+const char *hex_kernel_names[NUM_HEX_KERNELS] = { "scalar", "SSE2", "AVX2" };
+
+// digit value, or 0xFF for anything that isn't a hex digit
+static uint8_t hex_values[256];
+
+
+/**************************************************************************************************
+* Scalar kernel, one table lookup per digit
+*/
+static void InitHexValues(void)
+{
+	memset(hex_values, 0xFF, sizeof(hex_values));
+	for (int i = 0; i < 10; i++)
+		hex_values['0' + i] = i;
+	for (int i = 0; i < 6; i++)
+	{
+		hex_values['A' + i] = 10 + i;
+		hex_values['a' + i] = 10 + i;
+	}
+}
+
+static bool DecodeScalar(const char *hex, uint8_t *out, uint32_t len, uint8_t *sum)
+{
+	uint8_t invalid = 0;
+	uint8_t total = *sum;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		uint8_t hi = hex_values[(uint8_t)hex[i * 2]];
+		uint8_t lo = hex_values[(uint8_t)hex[i * 2 + 1]];
+		invalid |= hi | lo;			// only 0xFF has the top bits set
+		out[i] = (hi << 4) | (lo & 0x0F);
+		total += out[i];
+	}
+	*sum = total;
+	return (invalid & 0xF0) == 0;
+}
+
+#ifdef HEX_SSE2
+/**************************************************************************************************
+* SSE2 kernel. Digits are range checked and converted to nibbles with byte compares, then each
+* 16 bit lane of high and low nibble is merged and the lanes packed down to bytes. The merged lanes
+* are also summed with PSADBW, which is free next to the decoding.
+*/
+static bool DecodeSSE2(const char *hex, uint8_t *out, uint32_t len, uint8_t *sum)
+{
+	const __m128i digit_min = _mm_set1_epi8('0' - 1);
+	const __m128i digit_max = _mm_set1_epi8('9' + 1);
+	const __m128i alpha_min = _mm_set1_epi8('a' - 1);
+	const __m128i alpha_max = _mm_set1_epi8('f' + 1);
+	const __m128i lower_case = _mm_set1_epi8(0x20);
+	const __m128i alpha_offset = _mm_set1_epi8('a' - '0' - 10);
+	const __m128i low_byte = _mm_set1_epi16(0x00FF);
+	const __m128i ascii_zero = _mm_set1_epi8('0');
+	__m128i total = _mm_setzero_si128();
+
+	uint32_t i = 0;
+	for (; i + 8 <= len; i += 8)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)&hex[i * 2]);
+		__m128i lower = _mm_or_si128(c, lower_case);		// digits are unchanged
+		__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, digit_min), _mm_cmplt_epi8(c, digit_max));
+		__m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, alpha_min), _mm_cmplt_epi8(lower, alpha_max));
+		if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xFFFF)
+			return false;
+
+		__m128i nibbles = _mm_sub_epi8(_mm_sub_epi8(lower, ascii_zero), _mm_and_si128(is_alpha, alpha_offset));
+		__m128i bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nibbles, low_byte), 4), _mm_srli_epi16(nibbles, 8));
+		_mm_storel_epi64((__m128i *)&out[i], _mm_packus_epi16(bytes, bytes));
+		total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+	}
+	*sum += (uint8_t)_mm_cvtsi128_si32(_mm_add_epi64(total, _mm_srli_si128(total, 8)));
+	return DecodeScalar(&hex[i * 2], &out[i], len - i, sum);
+}
+#endif
+
+#ifdef HEX_AVX2
+/**************************************************************************************************
+* AVX2 kernel, as SSE2 with twice the width. Packing works within each 128 bit half, so the two
+* halves' results are gathered into the low half before storing.
+*/
+TARGET_AVX2 static bool DecodeAVX2(const char *hex, uint8_t *out, uint32_t len, uint8_t *sum)
+{
+	const __m256i digit_min = _mm256_set1_epi8('0' - 1);
+	const __m256i digit_max = _mm256_set1_epi8('9' + 1);
+	const __m256i alpha_min = _mm256_set1_epi8('a' - 1);
+	const __m256i alpha_max = _mm256_set1_epi8('f' + 1);
+	const __m256i lower_case = _mm256_set1_epi8(0x20);
+	const __m256i alpha_offset = _mm256_set1_epi8('a' - '0' - 10);
+	const __m256i low_byte = _mm256_set1_epi16(0x00FF);
+	const __m256i ascii_zero = _mm256_set1_epi8('0');
+	__m256i total = _mm256_setzero_si256();
+
+	uint32_t i = 0;
+	for (; i + 16 <= len; i += 16)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i *)&hex[i * 2]);
+		__m256i lower = _mm256_or_si256(c, lower_case);
+		__m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, digit_min), _mm256_cmpgt_epi8(digit_max, c));
+		__m256i is_alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, alpha_min), _mm256_cmpgt_epi8(alpha_max, lower));
+		if (_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != -1)
+			return false;
+
+		__m256i nibbles = _mm256_sub_epi8(_mm256_sub_epi8(lower, ascii_zero), _mm256_and_si256(is_alpha, alpha_offset));
+		__m256i bytes = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(nibbles, low_byte), 4), _mm256_srli_epi16(nibbles, 8));
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0x08);
+		_mm_storeu_si128((__m128i *)&out[i], _mm256_castsi256_si128(packed));
+		total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+	}
+	__m128i half = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+	*sum += (uint8_t)_mm_cvtsi128_si32(_mm_add_epi64(half, _mm_srli_si128(half, 8)));
+	_mm256_zeroupper();		// the compiler doesn't always before the tail call into SSE code
+	return DecodeSSE2(&hex[i * 2], &out[i], len - i, sum);
+}
+
+static bool CpuHasAVX2(void)
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+	__cpuid(regs, 1);
+	if (!(regs[2] & (1 << 27)) || ((_xgetbv(0) & 6) != 6))		// OS saves the YMM registers
+		return false;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+/**************************************************************************************************
+* Kernel selection. HexDecode starts out pointing at a resolver that picks the fastest kernel on
+* first use, call ResolveHexKernel() before decoding from more than one thread.
+*/
+static bool DecodeResolve(const char *hex, uint8_t *out, uint32_t len, uint8_t *sum)
+{
+	SelectBestHexKernel();
+	return HexDecode(hex, out, len, sum);
+}
+
+HEX_DECODE_t HexDecode = DecodeResolve;
+
+bool HexKernelSupported(HEX_KERNEL_t kernel)
+{
+	switch (kernel)
+	{
+		case HEX_KERNEL_SCALAR:
+			return true;
+#ifdef HEX_SSE2
+		case HEX_KERNEL_SSE2:
+			return true;
+#endif
+#ifdef HEX_AVX2
+		case HEX_KERNEL_AVX2:
+			return CpuHasAVX2();
+#endif
+		default:
+			return false;
+	}
+}
+
+bool SelectHexKernel(HEX_KERNEL_t kernel)
+{
+	if (!HexKernelSupported(kernel))
+		return false;
+	InitHexValues();		// every kernel finishes the tail with DecodeScalar()
+	switch (kernel)
+	{
+#ifdef HEX_SSE2
+		case HEX_KERNEL_SSE2:
+			HexDecode = DecodeSSE2;
+			break;
+#endif
+#ifdef HEX_AVX2
+		case HEX_KERNEL_AVX2:
+			HexDecode = DecodeAVX2;
+			break;
+#endif
+		default:
+			HexDecode = DecodeScalar;
+			break;
+	}
+	return true;
+}
+
+// pick the fastest kernel unless one has already been chosen
+void ResolveHexKernel(void)
+{
+	if (HexDecode == DecodeResolve)
+		SelectBestHexKernel();
+}
+
+void SelectBestHexKernel(void)
+{
+	for (int kernel = NUM_HEX_KERNELS - 1; kernel >= 0; kernel--)
+	{
+		if (SelectHexKernel((HEX_KERNEL_t)kernel))
+			return;
+	}
+}
@@ -0,0 +1,31 @@
+// hex_decode.h
+
+#ifndef __HEX_DECODE_H
+#define __HEX_DECODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef enum {
+	HEX_KERNEL_SCALAR,
+	HEX_KERNEL_SSE2,		// 16 digits per step
+	HEX_KERNEL_AVX2,		// 32 digits per step
+	NUM_HEX_KERNELS
+} HEX_KERNEL_t;
+
+// decode len bytes from 2 * len ASCII hex digits of either case, false if any digit is invalid.
+// The decoded bytes are also added to *sum, for record checksums.
+typedef bool (*HEX_DECODE_t)(const char *hex, uint8_t *out, uint32_t len, uint8_t *sum);
+
+
+extern HEX_DECODE_t HexDecode;			// fastest kernel the CPU supports unless one is selected
+extern const char *hex_kernel_names[NUM_HEX_KERNELS];
+
+extern bool HexKernelSupported(HEX_KERNEL_t kernel);
+extern bool SelectHexKernel(HEX_KERNEL_t kernel);
+extern void SelectBestHexKernel(void);
+extern void ResolveHexKernel(void);
+
+
+#endif
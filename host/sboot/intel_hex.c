@@ -5,13 +5,50 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#endif
 #include "intel_hex.h"
+#include "hex_decode.h"
 #include "crc.h"
 
+
+#define	MAX_PARSE_THREADS			64
+#define	MIN_PARSE_CHUNK				(256*1024)	// smaller files aren't worth starting threads for
+#define	MAX_CHECKSUM_REPORTS		10			// lines listed before just counting the rest
+#define	MIN_SKIPPED_BLANK			(8*1024)	// shorter blank runs are quicker to CRC than to skip
+
+// a range of lines parsed by one thread
+typedef struct {
+	const char	*start;
+	const char	*end;					// just after the last line's newline
+	uint32_t	base_addr;				// extended address in effect at the start, updated as records are parsed
+	uint8_t		*block_map;
+	uint32_t	min_addr;				// range of addresses written
+	int64_t		max_addr;				// -1 if nothing was
+	int			line_num;				// only known when parsing the whole file
+	bool		quiet;					// errors are reported by parsing again in one chunk
+	bool		ok;
+	bool		scan;					// first pass, only looking for address records
+	bool		has_base;
+	uint32_t	last_base;
+	uint32_t	clear_start;			// slice of firmware_buffer cleared by the first pass
+	uint32_t	clear_len;
+} HEX_CHUNK_t;
+
+
 uint8_t firmware_buffer[FIRMWARE_BUFFER_SIZE];
 uint32_t firmware_crc = 0;
 uint32_t firmware_size = 0;
 FW_INFO_t *fw_info = NULL;
+uint8_t firmware_block_map[FIRMWARE_BUFFER_SIZE / FIRMWARE_BLOCK_SIZE];	// non-zero if block has non-0xFF data
+int hex_parse_threads = 0;
 
 
 /**************************************************************************************************
@@ -30,102 +67,441 @@ uint32_t FindEmbeddedInfo(void)
 	return 0xFFFFFFFF;
 }
 
-uint32_t ReadBase16(char *c, int num_chars)
+/**************************************************************************************************
+* Map a whole file into memory read-only. Empty files get a zero length buffer.
+*/
+bool MapFile(const char *filename, MAPPED_FILE_t *file)
 {
-	uint32_t val = 0;
-
-	while (num_chars--)
+	file->data = "";
+	file->size = 0;
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	bool res = GetFileSizeEx(handle, &size);
+	if (res && (size.QuadPart > 0))
 	{
-		val += (*c <= '9' ? *c - '0' : *c - 'A' + 10) << (num_chars * 4);
-		c++;
+		// the view keeps the file open once the handles are closed
+		HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+		void *view = (mapping != NULL) ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+		if (mapping != NULL)
+			CloseHandle(mapping);
+		res = (view != NULL);
+		if (res)
+		{
+			file->data = view;
+			file->size = (size_t)size.QuadPart;
+		}
 	}
-
-	return val;
+	CloseHandle(handle);
+	return res;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	bool res = (fstat(fd, &st) == 0);
+	if (res && (st.st_size > 0))
+	{
+		void *view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		res = (view != MAP_FAILED);
+		if (res)
+		{
+#ifdef MADV_SEQUENTIAL
+			madvise(view, st.st_size, MADV_SEQUENTIAL);
+#endif
+			file->data = view;
+			file->size = st.st_size;
+		}
+	}
+	close(fd);
+	return res;
+#endif
 }
 
-// load an Intel hex file into buffer
-bool ReadHexFile(char *filename)
+void UnmapFile(MAPPED_FILE_t *file)
 {
-	FILE *fp;
-	bool res = true;
+	if (file->size == 0)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(file->data);
+#else
+	munmap((void *)file->data, file->size);
+#endif
+	file->size = 0;
+}
 
-	printf("\n");
+/**************************************************************************************************
+* Copy a decoded data record into firmware_buffer. Most records go in one piece, ones that wrap
+* around the end of their 64K segment or run past the buffer go a byte at a time.
+*/
+static bool StoreData(HEX_CHUNK_t *chunk, const uint8_t *data, uint8_t len, uint16_t addr)
+{
+	uint32_t absadr = chunk->base_addr + addr;
+	if (((uint32_t)addr + len <= 0x10000) && (absadr + len <= FIRMWARE_BUFFER_SIZE))
+	{
+		// copied along with the block map scan, a memcpy() of data the decoder has only just stored
+		// in narrower pieces stalls on store forwarding
+		uint8_t *dest = &firmware_buffer[absadr];
+		for (uint16_t i = 0; i < len; i++)
+		{
+			dest[i] = data[i];
+			if (data[i] != 0xFF)
+				chunk->block_map[(absadr + i) / FIRMWARE_BLOCK_SIZE] = 1;
+		}
+		if (len > 0)
+		{
+			if (absadr < chunk->min_addr)
+				chunk->min_addr = absadr;
+			if ((int64_t)absadr + len - 1 > chunk->max_addr)
+				chunk->max_addr = absadr + len - 1;
+		}
+		return true;
+	}
 
-	fp = fopen(filename, "r");
-	if (fp == NULL)
+	for (uint16_t i = 0; i < len; i++)
 	{
-		printf("Unable to open %s.\n", filename);
-		return false;
+		absadr = chunk->base_addr + (addr++);
+		if (absadr >= FIRMWARE_BUFFER_SIZE)
+		{
+			if (!chunk->quiet)
+				printf("Firmware image too large for buffer (%X).\n", absadr);
+			return false;
+		}
+		firmware_buffer[absadr] = data[i];
+		if (data[i] != 0xFF)
+			chunk->block_map[absadr / FIRMWARE_BLOCK_SIZE] = 1;
+		if (absadr < chunk->min_addr)
+			chunk->min_addr = absadr;
+		if (absadr > chunk->max_addr)
+			chunk->max_addr = absadr;
 	}
-	printf("Loading %s...\n", filename);
+	return true;
+}
 
-	memset(firmware_buffer, 0xFF, sizeof(firmware_buffer));
-	uint32_t	base_addr = 0;
+/**************************************************************************************************
+* Decode the lines of a chunk, starting from the base address left by the chunks before it.
+*
+* Records are decoded whole, checksum included, and the kernel sums the bytes as it goes, so
+* checking that the record sums to zero costs nothing extra. Lines with bad checksums are
+* still stored so that all of them can be reported, but the chunk fails at the end.
+*/
+static bool ParseChunk(HEX_CHUNK_t *chunk)
+{
+	chunk->min_addr = 0xFFFFFFFF;
+	chunk->max_addr = -1;
+	int bad_checksums = 0;
 
-	int line_num = 0;
-	while (feof(fp) != EOF)
+	const char *end = chunk->end;
+	const char *line = chunk->start;
+	while (line < end)
 	{
-		line_num++;
-		char line[1024];
-		if (fgets(line, sizeof(line), fp) == NULL)
-			break;
-		//printf("%u:\t%s", line_num, line);
+		chunk->line_num++;
+		const char *eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+		size_t line_len = eol - line;
 
 		if (line[0] != ':')
 		{
-			printf("Invalid line %d (missing colon)\n", line_num);
-			res = false;
-			break;
+			if (!chunk->quiet)
+				printf("Invalid line %d (missing colon)\n", chunk->line_num);
+			return false;
 		}
 
-		char *c = &line[1];
-		uint8_t len = ReadBase16(c, 2);
-		c += 2;
-		uint16_t addr = ReadBase16(c, 4);
-		c += 4;
-		uint8_t type = ReadBase16(c, 2);
-		c += 2;
-
-		//printf("%u\t%X\t%u\n", len, addr, type);
+		// usually the line holds exactly one record and decodes in one go, otherwise the header is
+		// decoded first to find out how much of the line is the record
+		uint8_t record[4 + 255 + 1];
+		uint8_t sum = 0;
+		size_t count = (line_len - 1) / 2;
+		if ((line_len < 11) || (count > sizeof(record)) || !HexDecode(&line[1], record, (uint32_t)count, &sum) ||
+			(count != 5 + (size_t)record[0]))
+		{
+			// length, address and type, then the data and checksum must fit on the line
+			sum = 0;
+			if ((line_len < 11) || !HexDecode(&line[1], record, 4, &sum) || (line_len < 11 + (size_t)record[0] * 2))
+			{
+				if (!chunk->quiet)
+					printf("Invalid line %d (truncated record)\n", chunk->line_num);
+				return false;
+			}
+			if (!HexDecode(&line[9], &record[4], record[0] + 1, &sum))
+			{
+				if (!chunk->quiet)
+					printf("Invalid line %d (bad hex digit)\n", chunk->line_num);
+				return false;
+			}
+		}
+		uint8_t len = record[0];
+		uint16_t addr = (record[1] << 8) | record[2];
+		uint8_t type = record[3];
+		const uint8_t *data = &record[4];
+		if (sum != 0)
+		{
+			bad_checksums++;
+			if (!chunk->quiet && (bad_checksums <= MAX_CHECKSUM_REPORTS))
+				printf("Invalid line %d (bad checksum: %02X, expected %02X)\n", chunk->line_num,
+					   data[len], (uint8_t)(data[len] - sum));
+		}
 
 		switch (type)
 		{
 		case 0:		// data record
-			for (uint16_t i = 0; i < len; i++)
-			{
-				uint32_t absadr = base_addr + (addr++);
-				if (absadr > FIRMWARE_BUFFER_SIZE)
-				{
-					printf("Firmware image too large for buffer (%X).\n", absadr);
-					res = false;
-					goto exit;
-				}
-				firmware_buffer[absadr] = ReadBase16(c, 2);
-				c += 2;
-				if (absadr > firmware_size)
-					firmware_size = absadr;
-			}
+			if (!StoreData(chunk, data, len, addr))
+				return false;
 			break;
 
 		case 2:		// extended segment address record
+		case 4:		// extended linear address record
 			if (len != 2)
 			{
-				printf("Invalid line %d (bad extended segment address length: %u)\n", line_num, len);
-				res = false;
-				break;
+				if (!chunk->quiet)
+					printf("Invalid line %d (bad extended address length: %u)\n", chunk->line_num, len);
+				return false;
 			}
-			base_addr = ReadBase16(c, 4) << 4;
-			//printf("%u:\tbase_addr = %X\n", line_num, base_addr);
-			c += 4;
+			chunk->base_addr = ((data[0] << 8) | data[1]) << ((type == 2) ? 4 : 16);
+			//printf("%u:\tbase_addr = %X\n", chunk->line_num, chunk->base_addr);
+			break;
 		}
 
-		uint8_t checksum = ReadBase16(c, 2);
-		// todo: check checksum
+		line = (eol < end) ? eol + 1 : end;
+	}
 
-		if (res != true)
-			break;
+	if (bad_checksums > 0)
+	{
+		if (!chunk->quiet && (bad_checksums > MAX_CHECKSUM_REPORTS))
+			printf("%d more lines with bad checksums\n", bad_checksums - MAX_CHECKSUM_REPORTS);
+		return false;
+	}
+	return true;
+}
+
+// decode Intel hex text into firmware_buffer
+bool ParseHex(const char *text, size_t size)
+{
+	memset(firmware_buffer, 0xFF, sizeof(firmware_buffer));
+	memset(firmware_block_map, 0, sizeof(firmware_block_map));
+
+	HEX_CHUNK_t chunk;
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.start = text;
+	chunk.end = text + size;
+	chunk.block_map = firmware_block_map;
+	bool res = ParseChunk(&chunk);
+	firmware_size = (chunk.max_addr > 0) ? (uint32_t)chunk.max_addr : 0;
+	return res;
+}
+
+/**************************************************************************************************
+* Parallel parsing. Lines only depend on each other through extended address records, so the text
+* is split at line boundaries into one chunk per thread. A first pass clears a slice of the image
+* and finds the last address record in each chunk, a prefix over those gives every chunk its
+* starting base address, and a second pass decodes the chunks. Each chunk fills its own block map,
+* merged at the end.
+*
+* If any chunk fails, or the address ranges of two chunks overlap so that the order of writes
+* matters, the whole file is parsed again by ParseHex() so that the result and any error message
+* are exactly the same.
+*/
+static void ScanChunk(HEX_CHUNK_t *chunk)
+{
+	memset(&firmware_buffer[chunk->clear_start], 0xFF, chunk->clear_len);
+	memset(chunk->block_map, 0, FIRMWARE_BUFFER_SIZE / FIRMWARE_BLOCK_SIZE);
+
+	// only the type field is checked here, the second pass rejects malformed records
+	chunk->has_base = false;
+	const char *line = chunk->start;
+	while (line < chunk->end)
+	{
+		const char *eol = memchr(line, '\n', chunk->end - line);
+		if (eol == NULL)
+			eol = chunk->end;
+		uint8_t value[2];
+		uint8_t sum = 0;
+		if ((eol - line >= 15) && (line[7] == '0') && ((line[8] == '2') || (line[8] == '4')) &&
+			HexDecode(&line[9], value, 2, &sum))
+		{
+			chunk->has_base = true;
+			chunk->last_base = ((value[0] << 8) | value[1]) << ((line[8] == '2') ? 4 : 16);
+		}
+		line = (eol < chunk->end) ? eol + 1 : chunk->end;
+	}
+}
+
+static void RunChunk(HEX_CHUNK_t *chunk)
+{
+	if (chunk->scan)
+		ScanChunk(chunk);
+	else
+		chunk->ok = ParseChunk(chunk);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ChunkThread(LPVOID arg)
+{
+	RunChunk((HEX_CHUNK_t *)arg);
+	return 0;
+}
+#else
+static void *ChunkThread(void *arg)
+{
+	RunChunk((HEX_CHUNK_t *)arg);
+	return NULL;
+}
+#endif
+
+// run every chunk on its own thread, the first one on the caller's
+static void RunChunks(HEX_CHUNK_t *chunks, int num_chunks)
+{
+#ifdef _WIN32
+	HANDLE threads[MAX_PARSE_THREADS];
+	for (int i = 1; i < num_chunks; i++)
+		threads[i] = CreateThread(NULL, 0, ChunkThread, &chunks[i], 0, NULL);
+	RunChunk(&chunks[0]);
+	for (int i = 1; i < num_chunks; i++)
+	{
+		if (threads[i] == NULL)
+		{
+			RunChunk(&chunks[i]);
+			continue;
+		}
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+#else
+	pthread_t threads[MAX_PARSE_THREADS];
+	bool started[MAX_PARSE_THREADS];
+	for (int i = 1; i < num_chunks; i++)
+		started[i] = (pthread_create(&threads[i], NULL, ChunkThread, &chunks[i]) == 0);
+	RunChunk(&chunks[0]);
+	for (int i = 1; i < num_chunks; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			RunChunk(&chunks[i]);
+	}
+#endif
+}
+
+int CpuCount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? (int)cpus : 1;
+#endif
+}
+
+// threads is 0 for one per CPU
+bool ParseHexParallel(const char *text, size_t size, int threads)
+{
+	if (threads <= 0)
+		threads = CpuCount();
+	if (threads > MAX_PARSE_THREADS)
+		threads = MAX_PARSE_THREADS;
+	if ((size_t)threads > size / MIN_PARSE_CHUNK)
+		threads = (int)(size / MIN_PARSE_CHUNK);
+	if (threads <= 1)
+		return ParseHex(text, size);
+
+	HEX_CHUNK_t *chunks = calloc(threads, sizeof(HEX_CHUNK_t));
+	uint8_t *maps = malloc((size_t)threads * (FIRMWARE_BUFFER_SIZE / FIRMWARE_BLOCK_SIZE));
+	if ((chunks == NULL) || (maps == NULL))
+	{
+		free(chunks);
+		free(maps);
+		return ParseHex(text, size);
+	}
+	ResolveHexKernel();		// before any thread calls HexDecode
+
+	const char *end = text + size;
+	const char *start = text;
+	for (int i = 0; i < threads; i++)
+	{
+		HEX_CHUNK_t *chunk = &chunks[i];
+		chunk->start = start;
+		if (i == threads - 1)
+			chunk->end = end;
+		else
+		{
+			const char *split = text + (size * (i + 1)) / threads;
+			if (split < start)
+				split = start;
+			const char *eol = memchr(split, '\n', end - split);
+			chunk->end = (eol != NULL) ? eol + 1 : end;
+		}
+		start = chunk->end;
+		chunk->block_map = &maps[(size_t)i * (FIRMWARE_BUFFER_SIZE / FIRMWARE_BLOCK_SIZE)];
+		chunk->clear_start = (uint32_t)(((uint64_t)FIRMWARE_BUFFER_SIZE * i) / threads);
+		chunk->clear_len = (uint32_t)(((uint64_t)FIRMWARE_BUFFER_SIZE * (i + 1)) / threads) - chunk->clear_start;
+		chunk->quiet = true;
+		chunk->scan = true;
+	}
+	RunChunks(chunks, threads);
+
+	uint32_t base_addr = 0;
+	for (int i = 0; i < threads; i++)
+	{
+		chunks[i].base_addr = base_addr;
+		if (chunks[i].has_base)
+			base_addr = chunks[i].last_base;
+		chunks[i].scan = false;
+	}
+	RunChunks(chunks, threads);
+
+	// chunks that wrote anything must not share addresses
+	bool ok = true;
+	int64_t max_addr = -1;
+	for (int i = 0; ok && (i < threads); i++)
+	{
+		ok = chunks[i].ok;
+		for (int j = i + 1; ok && (j < threads); j++)
+		{
+			if ((chunks[i].max_addr >= 0) && (chunks[j].max_addr >= 0) &&
+				(chunks[i].min_addr <= chunks[j].max_addr) && (chunks[j].min_addr <= chunks[i].max_addr))
+				ok = false;
+		}
+		if (chunks[i].max_addr > max_addr)
+			max_addr = chunks[i].max_addr;
 	}
 
+	if (ok)
+	{
+		memcpy(firmware_block_map, chunks[0].block_map, sizeof(firmware_block_map));
+		for (int i = 1; i < threads; i++)
+		{
+			for (int j = 0; j < FIRMWARE_BUFFER_SIZE / FIRMWARE_BLOCK_SIZE; j++)
+				firmware_block_map[j] |= chunks[i].block_map[j];
+		}
+		firmware_size = (max_addr > 0) ? (uint32_t)max_addr : 0;
+	}
+	free(chunks);
+	free(maps);
+	return ok ? true : ParseHex(text, size);
+}
+
+// load an Intel hex file into buffer
+bool ReadHexFile(char *filename)
+{
+	printf("\n");
+
+	MAPPED_FILE_t file;
+	if (!MapFile(filename, &file))
+	{
+		printf("Unable to open %s.\n", filename);
+		return false;
+	}
+	printf("Loading %s...\n", filename);
+
+	bool res = ParseHexParallel(file.data, file.size, hex_parse_threads);
+	if (!res)
+		goto exit;
+
 	printf("Firmware size:\t%u bytes (0x%X)\n", firmware_size, firmware_size);
 
 	// find embedded info
@@ -150,7 +526,7 @@ bool ReadHexFile(char *filename)
 	fw_info = &zzz;
 	fw_info->flash_size_b = 0x40000;
 	*/
-	firmware_crc = xmega_nvm_crc32(firmware_buffer, fw_info->flash_size_b);
+	firmware_crc = ImageNvmCrc(fw_info->flash_size_b);
 	printf("Firmware CRC:\t0x%lX\n", firmware_crc);
 
 	printf("Flash size:\t%u bytes (0x%X)\n", fw_info->flash_size_b, fw_info->flash_size_b);
@@ -159,6 +535,124 @@ bool ReadHexFile(char *filename)
 	printf("\n");
 
 exit:
-	fclose(fp);
+	UnmapFile(&file);
+	return res;
+}
+
+/**************************************************************************************************
+* NVM CRC of the first size bytes of the loaded image, the same as xmega_nvm_crc32() over them.
+* Long runs of blocks the block map shows to be blank are skipped over with xmega_nvm_crc32_fill()
+* instead of being read, most of a large device's flash usually is.
+*/
+uint32_t ImageNvmCrc(uint32_t size)
+{
+	uint32_t crc = 0;
+	uint32_t start = 0;			// of the data not yet included in crc
+	uint32_t addr = 0;
+	while (addr < size)
+	{
+		if (firmware_block_map[addr / FIRMWARE_BLOCK_SIZE])
+		{
+			addr += FIRMWARE_BLOCK_SIZE;
+			continue;
+		}
+		uint32_t end = addr;
+		while ((end < size) && !firmware_block_map[end / FIRMWARE_BLOCK_SIZE])
+			end += FIRMWARE_BLOCK_SIZE;
+		if (end > size)
+			end = size;
+
+		if (end - addr >= MIN_SKIPPED_BLANK)
+		{
+			crc = xmega_nvm_crc32_combine(crc, xmega_nvm_crc32(&firmware_buffer[start], addr - start), addr - start);
+			crc = xmega_nvm_crc32_fill(crc, 0xFF, end - addr);
+			start = end;
+		}
+		addr = end;
+	}
+	return xmega_nvm_crc32_combine(crc, xmega_nvm_crc32(&firmware_buffer[start], size - start), size - start);
+}
+
+/**************************************************************************************************
+* Check if a page of the loaded image contains any data. Pages that are entirely 0xFF don't need
+* to be written after the application section has been erased.
+*/
+bool PagePopulated(uint32_t page, uint32_t page_size)
+{
+	uint32_t addr = page * page_size;
+
+	if (page_size < FIRMWARE_BLOCK_SIZE)
+	{
+		for (uint32_t i = 0; i < page_size; i++)
+		{
+			if (firmware_buffer[addr + i] != 0xFF)
+				return true;
+		}
+		return false;
+	}
+
+	for (uint32_t block = addr / FIRMWARE_BLOCK_SIZE; block < (addr + page_size) / FIRMWARE_BLOCK_SIZE; block++)
+	{
+		if (firmware_block_map[block])
+			return true;
+	}
+	return false;
+}
+
+/**************************************************************************************************
+* Write a record to an Intel hex file
+*/
+void WriteHexRecord(FILE *fp, uint8_t type, uint16_t addr, const uint8_t *data, uint8_t len)
+{
+	uint8_t checksum = len + (addr >> 8) + (addr & 0xFF) + type;
+	fprintf(fp, ":%02X%04X%02X", len, addr, type);
+	for (uint8_t i = 0; i < len; i++)
+	{
+		fprintf(fp, "%02X", data[i]);
+		checksum += data[i];
+	}
+	fprintf(fp, "%02X\n", (uint8_t)-checksum);
+}
+
+// save size bytes of buffer as an Intel hex file, lines that are all 0xFF are left out
+bool WriteHexFile(char *filename, const uint8_t *buffer, uint32_t size)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
+	{
+		printf("Unable to create %s.\n", filename);
+		return false;
+	}
+
+	// extended segment address records, as ReadHexFile() understands, reach the whole buffer
+	uint32_t base_addr = 0;
+	for (uint32_t addr = 0; addr < size; addr += HEX_RECORD_SIZE)
+	{
+		uint8_t len = (size - addr < HEX_RECORD_SIZE) ? size - addr : HEX_RECORD_SIZE;
+		uint8_t i;
+		for (i = 0; i < len; i++)
+		{
+			if (buffer[addr + i] != 0xFF)
+				break;
+		}
+		if (i == len)
+			continue;
+
+		if ((addr & 0xFFFF0000) != base_addr)
+		{
+			base_addr = addr & 0xFFFF0000;
+			uint16_t segment = base_addr >> 4;
+			uint8_t data[2] = { segment >> 8, segment & 0xFF };
+			WriteHexRecord(fp, 2, 0, data, 2);
+		}
+		WriteHexRecord(fp, 0, addr & 0xFFFF, &buffer[addr], len);
+	}
+	WriteHexRecord(fp, 1, 0, NULL, 0);
+
+	bool res = (ferror(fp) == 0);
+	if (fclose(fp) != 0)
+		res = false;
+	if (!res)
+		printf("Unable to write %s.\n", filename);
 	return res;
-}
\ No newline at end of file
+}
@@ -5,6 +5,8 @@
 
 
 #define	FIRMWARE_BUFFER_SIZE		(1024*1024)
+#define	FIRMWARE_BLOCK_SIZE			128			// smallest XMEGA flash page
+#define	HEX_RECORD_SIZE				16			// data bytes per line written
 
 
 // data embedded in firmware image
@@ -23,13 +25,30 @@ typedef struct {
 #define	MAGIC_STRING				"YamaNeko"
 
 
+// a file mapped read-only into memory
+typedef struct {
+	const char	*data;
+	size_t		size;
+} MAPPED_FILE_t;
+
+
 extern uint8_t firmware_buffer[FIRMWARE_BUFFER_SIZE];
 extern uint32_t firmware_crc;
 extern uint32_t firmware_size;
 extern FW_INFO_t *fw_info;
+extern int hex_parse_threads;			// 0 for one per CPU
+extern uint8_t firmware_block_map[FIRMWARE_BUFFER_SIZE / FIRMWARE_BLOCK_SIZE];
 
 
+extern bool MapFile(const char *filename, MAPPED_FILE_t *file);
+extern void UnmapFile(MAPPED_FILE_t *file);
+extern bool ParseHex(const char *text, size_t size);
+extern bool ParseHexParallel(const char *text, size_t size, int threads);
+extern int CpuCount(void);
 extern bool ReadHexFile(char *filename);
+extern bool PagePopulated(uint32_t page, uint32_t page_size);
+extern uint32_t ImageNvmCrc(uint32_t size);
+extern bool WriteHexFile(char *filename, const uint8_t *buffer, uint32_t size);
 
 
 #endif
\ No newline at end of file
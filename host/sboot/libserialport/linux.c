@@ -55,6 +55,10 @@ SP_PRIV enum sp_return get_port_details(struct sp_port *port)
 	if (strncmp(port->name, "/dev/", 5))
 		RETURN_ERROR(SP_ERR_ARG, "Device name not recognized");
 
+	/* Pseudo terminals have no sysfs entry, treat them as native ports. */
+	if (!strncmp(dev, "pts/", 4))
+		RETURN_OK();
+
 	snprintf(link_name, sizeof(link_name), "/sys/class/tty/%s", dev);
 	if (lstat(link_name, &statbuf) == -1)
 		RETURN_ERROR(SP_ERR_ARG, "Device not found");
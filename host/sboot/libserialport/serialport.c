@@ -1768,8 +1768,12 @@ static enum sp_return get_config(struct sp_port *port, struct port_data *data,
 	if (tcgetattr(port->fd, &data->term) < 0)
 		RETURN_FAIL("tcgetattr() failed");
 
-	if (ioctl(port->fd, TIOCMGET, &data->controlbits) < 0)
-		RETURN_FAIL("TIOCMGET ioctl failed");
+	if (ioctl(port->fd, TIOCMGET, &data->controlbits) < 0) {
+		/* Pseudo terminals have no modem control lines. */
+		if (errno != ENOTTY && errno != EINVAL)
+			RETURN_FAIL("TIOCMGET ioctl failed");
+		data->controlbits = 0;
+	}
 
 #ifdef USE_TERMIOX
 	int ret = get_flow(port->fd, data);
@@ -2180,7 +2184,7 @@ static enum sp_return set_config(struct sp_port *port, struct port_data *data,
 				} else {
 					controlbits = TIOCM_RTS;
 					if (ioctl(port->fd, config->rts == SP_RTS_ON ? TIOCMBIS : TIOCMBIC,
-							&controlbits) < 0)
+							&controlbits) < 0 && errno != ENOTTY && errno != EINVAL)
 						RETURN_FAIL("Setting RTS signal level failed");
 				}
 			}
@@ -2213,7 +2217,7 @@ static enum sp_return set_config(struct sp_port *port, struct port_data *data,
 			if (config->dtr >= 0) {
 				controlbits = TIOCM_DTR;
 				if (ioctl(port->fd, config->dtr == SP_DTR_ON ? TIOCMBIS : TIOCMBIC,
-						&controlbits) < 0)
+						&controlbits) < 0 && errno != ENOTTY && errno != EINVAL)
 					RETURN_FAIL("Setting DTR signal level failed");
 			}
 		}
@@ -5,28 +5,92 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "intel_hex.h"
+#include "crc.h"
+#include "compress.h"
+#include "bench.h"
+#include "timing.h"
 #include "bootloader.h"
+#include "session.h"
 #include "getopt.h"
 #include "libserialport/libserialport.h"
 
-#define	DEFAULT_TIMEOUT_MS		1000
+#define	DEFAULT_TIMEOUT_MS		1000	// response turnaround until it has been measured
+#define	MIN_TIMEOUT_MS			20		// USB adapter latency and OS scheduling jitter
+#define	DISCOVERY_BURST_MS		10		// NOPs kept queued for the port while waiting for the bootloader
+#define	PAGE_CRCS_PER_REQUEST	64
+#define	MAX_PORTS				64
+
+// page_actions flags
+#define	PAGE_ERASE				(1<<0)
+#define	PAGE_WRITE				(1<<1)
+#define	FRAME_RETRIES			3
+#define	FRAME_RESYNC_MS			100
+#define	WINDOW_GAP_US			1000	// NOPs after each windowed frame, covers loading the NVM buffer and lost bytes
+#define	MAX_NODES				256
+#define	BROADCAST_ENTRY_MS		2500	// longer than the bootloader's start-up window
 
 
-void WaitForBootloader(void);
-void UpdateFirmware(void);
-bool GetBootloaderInfo(void);
+bool WaitForBootloader(SESSION_t *s);
+bool ConfirmBaud(SESSION_t *s, int attempts);
+bool PingDefaultBaud(SESSION_t *s, int attempts);
+bool NegotiateBaud(SESSION_t *s, int baud);
+bool Command(SESSION_t *s, char *cmd, int len);
+bool SetTurnaround(SESSION_t *s, int us);
+bool BroadcastCommand(SESSION_t *s, char *cmd, int len);
+unsigned int WriteTimeout(SESSION_t *s, int len);
+unsigned int ResponseTimeout(SESSION_t *s, int tx, int rx, int device_ms);
+void ResyncFrames(SESSION_t *s, int len);
+bool UpdateFirmware(SESSION_t *s);
+bool VerifyFirmware(SESSION_t *s);
+bool GetBootloaderInfo(SESSION_t *s);
+bool CheckDeviceInfo(SESSION_t *s);
+void SessionPrintf(SESSION_t *s, const char *format, ...);
+void WriteTimingJson(char *filename);
+void PrintCycleStats(SESSION_t *s, const char *prefix);
+char *SerialToHex(const uint8_t *serial, char *hex);
+bool ReadNodeList(char *filename);
+bool BroadcastUpdate(SESSION_t *s);
+bool ReadSerial(SESSION_t *s, uint8_t *serial);
+bool ReadVersion(SESSION_t *s);
+void ReadCycleStats(SESSION_t *s);
+bool ApplyPageActions(SESSION_t *s, uint8_t *page_actions, int num_pages, int num_actions);
+bool DumpFirmware(SESSION_t *s);
 
 
-uint8_t target_mcu_id[4] = { 0, 0, 0, 0 };
-uint8_t	target_mcu_fuses[6] = { 0, 0, 0, 0, 0, 0 };
 char *hexfile = NULL;
-char *port_name = NULL;
+char *port_names[MAX_PORTS];
 bool opt_list_ports = false;
+bool opt_pipelined = false;
+bool opt_framed = false;
+bool opt_compressed = false;
+bool opt_bench = false;
+bool opt_differential = false;
+int opt_baud = 0;
+int opt_window = 0;
+int opt_discovery_s = 0;
+int opt_turnaround = -1;
+bool opt_serial = false;
+bool opt_timing = false;
+bool opt_dump = false;
+char *json_file = NULL;
+uint64_t hex_parse_us = 0;
+char *nodes_file = NULL;
+uint8_t nodes[MAX_NODES][NODE_SERIAL_LENGTH];
+int num_nodes = 0;
 
-struct sp_port *port;
+SESSION_t *sessions = NULL;
+int num_sessions = 0;
 
 
 /**************************************************************************************************
@@ -34,49 +98,145 @@ struct sp_port *port;
 */
 int parse_args(int argc, char *argv[])
 {
+	static const struct option long_options[] = {
+		{ "dump",	no_argument,	NULL,	'r' },
+		{ NULL,		0,				NULL,	0 }
+	};
 	int c;
 
-	while ((c = getopt(argc, argv, "l")) != -1)
+	while ((c = getopt_long(argc, argv, "lpfzw:db:Bsm:tj:D:T:", long_options, NULL)) != -1)
 	{
 		switch (c)
 		{
+		case 'r':
+			opt_dump = true;
+			break;
+
 		case 'l':
 			opt_list_ports = true;
 			break;
 
+		case 'p':
+			opt_pipelined = true;
+			break;
+
+		case 'f':
+			opt_framed = true;
+			break;
+
+		case 'z':
+			opt_compressed = true;
+			break;
+
+		case 'B':
+			opt_bench = true;
+			break;
+
+		case 'w':
+			opt_window = atoi(optarg);
+			if ((opt_window < 1) || (opt_window > WINDOW_MAX_FRAMES))
+			{
+				printf("Window size must be 1 to %d.\n", WINDOW_MAX_FRAMES);
+				return 1;
+			}
+			break;
+
+		case 'd':
+			opt_differential = true;
+			break;
+
+		case 'b':
+			opt_baud = atoi(optarg);
+			break;
+
+		case 's':
+			opt_serial = true;
+			break;
+
+		case 'm':
+			nodes_file = optarg;
+			break;
+
+		case 't':
+			opt_timing = true;
+			break;
+
+		case 'D':
+			opt_discovery_s = atoi(optarg);
+			break;
+
+		case 'T':
+			opt_turnaround = atoi(optarg);
+			if ((opt_turnaround < 0) || (opt_turnaround > 65535))
+			{
+				printf("Turnaround must be 0 to 65535 us.\n");
+				return 1;
+			}
+			break;
+
+		case 'j':
+			json_file = optarg;
+			break;
+
 		case '?':
 			printf("Unknown option -%c.\n", optopt);
 			return 1;
 		}
 	}
 
-	// non option arguments
-	int j = 0;
-	for (int i = optind; i < argc; i++)
+	// non option arguments, the last one is the hex file and any before it are ports
+	int j = argc - optind;
+	if (j > 0)
+		hexfile = argv[argc - 1];
+	for (int i = optind; i < argc - 1; i++)
 	{
 		//printf("Opt: %s\n", argv[i]);
-		switch (j)
+		if (opt_bench || (num_sessions >= MAX_PORTS))
 		{
-		case 0:
-			port_name = argv[i];
-			break;
-
-		case 1:
-			hexfile = argv[i];
-			break;
-
-		default:
 			printf("Too many arguments.\n");
 			return 1;
 		}
-		j++;
+		port_names[num_sessions++] = argv[i];
 	}
 
-	if ((j < 2) && (!opt_list_ports))
+	if ((j < (opt_bench ? 1 : 2)) && (!opt_list_ports))
 	{
-		printf("Usage: sboot [-l] <port> <firmware.hex>\n");
+		printf("Usage: sboot [-l] [-p] [-f] [-z] [-w frames] [-d] [-b baud] [-s] [-t] [-j file] [-D seconds] [-T us] <port>... <firmware.hex>\n");
+		printf("       sboot -m nodes.txt [-p] [-f] [-z] [-w frames] <port> <firmware.hex>\n");
+		printf("       sboot -B [-b baud] <firmware.hex>\n");
+		printf("       sboot --dump [-b baud] <port> <backup.hex|backup.bin>\n");
 		printf("Example: sboot COM1 app.hex\n");
+		printf("         sboot COM1 COM2 COM3 app.hex    Flash three devices in parallel\n");
 		printf("Options: -l    List ports\n");
+		printf("         -p    Pipelined page writes (bootloader version 2+)\n");
+		printf("         -f    Framed page writes, one write and one response per page (bootloader version 2+)\n");
+		printf("         -z    Compressed page writes, framed (bootloader version 2+)\n");
+		printf("         -w    Windowed page writes, up to 32 frames between acknowledgements (bootloader version 2+)\n");
+		printf("         -d    Differential update, only rewrite changed pages (bootloader version 2+)\n");
+		printf("         -b    Switch to baud rate after connecting, 38400 to 2000000 (bootloader version 2+)\n");
+		printf("         -B    Benchmark parsing the hex file, its NVM CRC, and compression at the -b baud rate, no port needed\n");
+		printf("         -s    Print the device serial number, its RS485 node address (bootloader version 2+)\n");
+		printf("         -D    Give up if the bootloader isn't found within this many seconds (default: wait forever)\n");
+		printf("         -T    Time the adapter needs to release the RS485 bus, the bootloader waits this long\n");
+		printf("               before responding (default: 11000, 0 for adapters that switch within a bit)\n");
+		printf("         -t    Print the time spent in each phase and page write/response histograms\n");
+		printf("         -j    Write the timing of each phase and page to a JSON file\n");
+		printf("         -m    RS485 broadcast to the nodes listed in a file, one serial number per line.\n");
+		printf("               Other options apply to repairs of individual nodes. (bootloader version 2+)\n");
+		printf("         --dump Save the application section to a .hex file, or raw to a .bin (bootloader version 6+).\n");
+		printf("               The device stays in the bootloader.\n");
+		return 1;
+	}
+
+	if ((nodes_file != NULL) && ((num_sessions != 1) || (opt_baud != 0)))
+	{
+		printf("Broadcast mode uses one port at the default baud rate.\n");
+		return 1;
+	}
+
+	if (opt_dump && ((num_sessions != 1) || (nodes_file != NULL) || opt_bench))
+	{
+		printf("Dump reads one device through one port.\n");
 		return 1;
 	}
 
@@ -125,28 +285,263 @@ void list_ports(void)
 */
 int check(enum sp_return result)
 {
-	/* For this example we'll just exit on any error by calling abort(). */
+	// errors are reported and returned, so that one failed port doesn't stop the others
 	char *error_message;
  
 	switch (result) {
 		case SP_ERR_ARG:
 			printf("Error: Invalid argument.\n");
-			abort();
+			break;
 		case SP_ERR_FAIL:
 			error_message = sp_last_error_message();
 			printf("Error: Failed: %s\n", error_message);
 			sp_free_error_message(error_message);
-			abort();
+			break;
 		case SP_ERR_SUPP:
 			printf("Error: Not supported.\n");
-			abort();
+			break;
 		case SP_ERR_MEM:
 			printf("Error: Couldn't allocate memory.\n");
-			abort();
+			break;
 		case SP_OK:
 	default:
-		return result;
+		break;
+	}
+	return result;
+}
+
+/**************************************************************************************************
+* printf() for a session, prefixed with the port name when flashing more than one device
+*/
+void SessionPrintf(SESSION_t *s, const char *format, ...)
+{
+	char buffer[256];
+	int len = 0;
+	if (num_sessions > 1)
+		len = snprintf(buffer, sizeof(buffer), "%s: ", s->port_name);
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(&buffer[len], sizeof(buffer) - len, format, args);
+	va_end(args);
+	fputs(buffer, stdout);		// one call so lines from different threads don't mix
+}
+
+/**************************************************************************************************
+* Portable sleep
+*/
+void SleepMs(int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/**************************************************************************************************
+* Format a node serial number as hex, hex must hold NODE_SERIAL_LENGTH * 2 + 1 chars
+*/
+char *SerialToHex(const uint8_t *serial, char *hex)
+{
+	for (int i = 0; i < NODE_SERIAL_LENGTH; i++)
+		sprintf(&hex[i * 2], "%02X", serial[i]);
+	return hex;
+}
+
+/**************************************************************************************************
+* Load the list of RS485 node serial numbers, as printed by -s. Blank lines and anything after
+* a # are ignored.
+*/
+bool ReadNodeList(char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		printf("Unable to open %s.\n", filename);
+		return false;
+	}
+
+	char line[256];
+	int line_num = 0;
+	bool result = true;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line_num++;
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+
+		int digits = 0;
+		uint8_t serial[NODE_SERIAL_LENGTH];
+		for (char *p = line; *p != '\0'; p++)
+		{
+			if (isspace((unsigned char)*p))
+				continue;
+			if (!isxdigit((unsigned char)*p) || (digits >= NODE_SERIAL_LENGTH * 2))
+			{
+				digits = -1;
+				break;
+			}
+			int nibble = isdigit((unsigned char)*p) ? *p - '0' : toupper((unsigned char)*p) - 'A' + 10;
+			if (digits & 1)
+				serial[digits / 2] |= nibble;
+			else
+				serial[digits / 2] = nibble << 4;
+			digits++;
+		}
+		if (digits == 0)
+			continue;
+		if ((digits != NODE_SERIAL_LENGTH * 2) || (num_nodes >= MAX_NODES))
+		{
+			printf("%s line %d: expected a %d digit hex serial number.\n", filename, line_num, NODE_SERIAL_LENGTH * 2);
+			result = false;
+			break;
+		}
+		memcpy(nodes[num_nodes++], serial, NODE_SERIAL_LENGTH);
+	}
+	fclose(fp);
+
+	if (result && (num_nodes == 0))
+	{
+		printf("No nodes in %s.\n", filename);
+		result = false;
+	}
+	return result;
+}
+
+/**************************************************************************************************
+* Open the port and update one device
+*/
+void RunSession(SESSION_t *s)
+{
+	TimingStart(&s->timing);
+	s->baud = DEFAULT_BAUD;
+	if (!opt_dump)
+	{
+		s->frame = malloc(5 + fw_info->page_size_b + 2);
+		if (s->frame == NULL)
+		{
+			SessionPrintf(s, "Out of memory.\n");
+			return;
+		}
+	}
+
+	// open port
+	if ((check(sp_get_port_by_name(s->port_name, &s->port)) != SP_OK) ||
+		(check(sp_open(s->port, SP_MODE_READ_WRITE)) != SP_OK) ||
+		(check(sp_set_baudrate(s->port, DEFAULT_BAUD)) != SP_OK) ||
+        (check(sp_set_bits(s->port, 8)) != SP_OK) ||
+        (check(sp_set_parity(s->port, SP_PARITY_NONE)) != SP_OK) ||
+        (check(sp_set_stopbits(s->port, 1)) != SP_OK) ||
+        (check(sp_set_flowcontrol(s->port, SP_FLOWCONTROL_NONE)) != SP_OK))
+	{
+		SessionPrintf(s, "Unable to open port.\n");
+		goto exit;
+	}
+
+	// every node on the bus would answer a NOP, broadcast mode never waits for a response
+	if (num_nodes > 0)
+	{
+		s->ok = BroadcastUpdate(s);
+		goto exit;
+	}
+
+	// wait for bootloader to start
+	TimingPhase(&s->timing, PHASE_DISCOVERY);
+	if (!WaitForBootloader(s))
+	{
+		if (opt_discovery_s)
+			SessionPrintf(s, "Bootloader not found within %d seconds.\n", opt_discovery_s);
+		else
+			SessionPrintf(s, "Bootloader not found.\n");
+		goto exit;
+	}
+
+	if ((opt_turnaround >= 0) && !SetTurnaround(s, opt_turnaround))
+		goto exit;
+
+	// version 7+ report everything else in one round trip, older bootloaders need a command for each
+	// item and would leave CMD_READ_INFO to time out
+	if (!ReadVersion(s))
+		goto exit;
+	if (s->version >= 7)
+		GetBootloaderInfo(s);
+
+	if (opt_serial)
+	{
+		uint8_t serial[NODE_SERIAL_LENGTH];
+		char hex[NODE_SERIAL_LENGTH * 2 + 1];
+		if (s->has_info)
+			memcpy(serial, s->info.serial, NODE_SERIAL_LENGTH);
+		else if (!ReadSerial(s, serial))
+			goto exit;
+		SessionPrintf(s, "Serial:\t\t%s\n", SerialToHex(serial, hex));
+	}
+
+	if ((opt_baud != 0) && (opt_baud != DEFAULT_BAUD))
+	{
+		TimingPhase(&s->timing, PHASE_BAUD);
+		if (!NegotiateBaud(s, opt_baud))
+			goto exit;
+	}
+
+	if (opt_dump)
+		s->ok = DumpFirmware(s);
+	else
+		s->ok = UpdateFirmware(s);
+
+exit:
+	TimingEnd(&s->timing);
+	if (s->port != NULL)
+	{
+		sp_close(s->port);
+		sp_free_port(s->port);
+	}
+	free(s->frame);
+}
+
+#ifdef _WIN32
+DWORD WINAPI SessionThread(LPVOID arg)
+{
+	RunSession((SESSION_t *)arg);
+	return 0;
+}
+#else
+void *SessionThread(void *arg)
+{
+	RunSession((SESSION_t *)arg);
+	return NULL;
+}
+#endif
+
+/**************************************************************************************************
+* Run all sessions in parallel, one thread per port
+*/
+void RunSessions(void)
+{
+#ifdef _WIN32
+	HANDLE threads[MAX_PORTS];
+	for (int i = 0; i < num_sessions; i++)
+		threads[i] = CreateThread(NULL, 0, SessionThread, &sessions[i], 0, NULL);
+	for (int i = 0; i < num_sessions; i++)
+	{
+		if (threads[i] == NULL)
+			continue;
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+#else
+	pthread_t threads[MAX_PORTS];
+	bool started[MAX_PORTS];
+	for (int i = 0; i < num_sessions; i++)
+		started[i] = (pthread_create(&threads[i], NULL, SessionThread, &sessions[i]) == 0);
+	for (int i = 0; i < num_sessions; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
 	}
+#endif
 }
 
 int main(int argc, char* argv[])
@@ -163,198 +558,1356 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 
-	// load the hex file
-	if (!ReadHexFile(hexfile))
+	// load the hex file, with --dump it is the file to create
+	uint64_t parse_start = TimeUs();
+	if (!opt_dump && !ReadHexFile(hexfile))
 		return -1;
+	hex_parse_us = TimeUs() - parse_start;
 
-	// open port
-	if ((check(sp_get_port_by_name(port_name, &port)) != SP_OK) ||
-		(check(sp_open(port, SP_MODE_READ_WRITE)) != SP_OK) ||
-		(check(sp_set_baudrate(port, 19200)) != SP_OK) ||
-        (check(sp_set_bits(port, 8)) != SP_OK) ||
-        (check(sp_set_parity(port, SP_PARITY_NONE)) != SP_OK) ||
-        (check(sp_set_stopbits(port, 1)) != SP_OK) ||
-        (check(sp_set_flowcontrol(port, SP_FLOWCONTROL_NONE)) != SP_OK))
+	if (opt_bench)
+	{
+		BenchHexParse(hexfile);
+		BenchNvmCrc();
+		BenchCompression(opt_baud ? opt_baud : DEFAULT_BAUD);
+		return 0;
+	}
+
+	if ((nodes_file != NULL) && !ReadNodeList(nodes_file))
 		return -1;
 
-	// wait for bootloader to start
-	WaitForBootloader();
-	printf("Bootloader found.\n");
+	sessions = calloc(num_sessions, sizeof(SESSION_t));
+	if (sessions == NULL)
+	{
+		printf("Out of memory.\n");
+		return -1;
+	}
+	for (int i = 0; i < num_sessions; i++)
+		sessions[i].port_name = port_names[i];
 
-	UpdateFirmware();
+	if (num_sessions == 1)
+		RunSession(&sessions[0]);
+	else
+		RunSessions();
 
-#if 0
-	// get bootloader info
-	if (!GetBootloaderInfo(handle))
-		return 1;
+	int failed = 0;
+	for (int i = 0; i < num_sessions; i++)
+	{
+		if (!sessions[i].ok)
+			failed++;
+	}
+	if (num_sessions > 1)
+	{
+		printf("\n%d of %d devices updated.\n", num_sessions - failed, num_sessions);
+		for (int i = 0; i < num_sessions; i++)
+		{
+			if (!sessions[i].ok)
+				printf("Failed: %s\n", sessions[i].port_name);
+		}
+	}
+	if (opt_timing)
+	{
+		printf("\nHex parsing:\t%.3f s\n", hex_parse_us / 1000000.0);
+		for (int i = 0; i < num_sessions; i++)
+		{
+			char prefix[256] = "";
+			if (num_sessions > 1)
+				snprintf(prefix, sizeof(prefix), "%s: ", sessions[i].port_name);
+			TimingPrint(&sessions[i].timing, prefix);
+			if (sessions[i].rtt_samples > 0)
+				printf("%sTurnaround:\t%.2f ms +/- %.2f ms\n", prefix, sessions[i].srtt_us / 1000.0, sessions[i].rttvar_us / 1000.0);
+			PrintCycleStats(&sessions[i], prefix);
+		}
+	}
+	if (json_file != NULL)
+		WriteTimingJson(json_file);
+	for (int i = 0; i < num_sessions; i++)
+		TimingFree(&sessions[i].timing);
+	free(sessions);
 
-	// read .hex file
-	if (!ReadHexFile(hexfile))
-		return 1;
+	return failed ? -1 : 0;
+}
+
+/**************************************************************************************************
+* Bootloader CPU load while receiving pages. A byte takes 10 bit times, so the busy cycles per byte
+* give the fastest baud rate the bootloader could keep up with.
+*/
+void PrintCycleStats(SESSION_t *s, const char *prefix)
+{
+	if ((s->device_hz == 0) || (s->device_rx_bytes == 0) || (s->device_rx_cycles == 0))
+		return;
+	uint32_t busy = s->device_rx_cycles - s->device_wait_cycles;
+	printf("%sDevice RX:\t%.1f cycles per byte busy, %d%% idle", prefix,
+		   (double)busy / s->device_rx_bytes, (int)(((uint64_t)s->device_wait_cycles * 100) / s->device_rx_cycles));
+	if (busy > 0)
+		printf(", keeps up to %llu baud", (unsigned long long)(((uint64_t)s->device_hz * 10 * s->device_rx_bytes) / busy));
+	printf("\n");
+}
 
-	// check firmware is suitable for target
-	if (memcmp(&fw_info->mcu_signature, target_mcu_id, 3) != 0)
+/**************************************************************************************************
+* Write the timing of every session as JSON
+*/
+void WriteTimingJson(char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+	if (fp == NULL)
 	{
-		printf("Target MCU is wrong type.\n");
-		return 1;
+		printf("Unable to create %s.\n", filename);
+		return;
 	}
 
-	if (!UpdateFirmware(handle))
-		return 1;
+	const char *mode = "page";
+	if (opt_dump)
+		mode = "dump";
+	else if (opt_window)
+		mode = "windowed";
+	else if (opt_compressed)
+		mode = "compressed";
+	else if (opt_framed)
+		mode = "framed";
+	else if (opt_pipelined)
+		mode = "pipelined";
 
-	printf("\nFirmware update complete.\n");
-#endif
-	return 0;
+	fprintf(fp, "{\n\t\"hex_file\": ");
+	JsonString(fp, hexfile);
+	fprintf(fp, ",\n\t\"hex_parse_us\": %llu,\n", (unsigned long long)hex_parse_us);
+	fprintf(fp, "\t\"mode\": \"%s\",\n\t\"window\": %d,\n\t\"differential\": %s,\n", mode, opt_window, opt_differential ? "true" : "false");
+	fprintf(fp, "\t\"sessions\": [");
+	for (int i = 0; i < num_sessions; i++)
+	{
+		SESSION_t *s = &sessions[i];
+		fprintf(fp, "%s\n\t\t{\n\t\t\t\"port\": ", i ? "," : "");
+		JsonString(fp, s->port_name);
+		fprintf(fp, ",\n\t\t\t\"ok\": %s,\n\t\t\t\"baud\": %d,\n", s->ok ? "true" : "false", s->baud);
+		fprintf(fp, "\t\t\t\"srtt_us\": %lld,\n\t\t\t\"rttvar_us\": %lld,\n", (long long)s->srtt_us, (long long)s->rttvar_us);
+		if (s->device_hz != 0)
+		{
+			fprintf(fp, "\t\t\t\"device_rx\": { \"hz\": %lu, \"bytes\": %lu, \"cycles\": %lu, \"wait_cycles\": %lu },\n",
+					(unsigned long)s->device_hz, (unsigned long)s->device_rx_bytes, (unsigned long)s->device_rx_cycles, (unsigned long)s->device_wait_cycles);
+		}
+		TimingWriteJson(fp, &s->timing, "\t\t\t");
+		fprintf(fp, "\t\t}");
+	}
+	fprintf(fp, "\n\t]\n}\n");
+	fclose(fp);
 }
 
 /**************************************************************************************************
-* Look for bootloader
+* Look for bootloader. NOPs are sent back to back so that one arrives as soon as the bootloader's
+* start-up window opens, with only DISCOVERY_BURST_MS worth queued at a time so they don't delay
+* the first command. Nothing is flushed, the bootloader's 'A' is picked up as soon as it arrives
+* and any NOPs still in flight are ignored by it. Returns false if opt_discovery_s passes first.
 */
-void WaitForBootloader(void)
+bool WaitForBootloader(SESSION_t *s)
 {
-	printf("Waiting for bootloader... CTRL-C to cancel.\n");
+	if (opt_discovery_s)
+		SessionPrintf(s, "Waiting up to %d seconds for bootloader...\n", opt_discovery_s);
+	else
+		SessionPrintf(s, "Waiting for bootloader... CTRL-C to cancel.\n");
 
-	//char nop[] = "\0n\0";
-	char nop = 'n';
-	char res = 0;
+	int burst_len = (s->baud * DISCOVERY_BURST_MS) / 10000 + 1;
+	uint8_t *burst = malloc(burst_len);
+	struct sp_event_set *events = NULL;
+	bool found = false;
+	if ((burst == NULL) || (check(sp_new_event_set(&events)) != SP_OK) ||
+		(check(sp_add_port_events(events, s->port, SP_EVENT_RX_READY)) != SP_OK))
+	{
+		SessionPrintf(s, "Unable to wait for port events.\n");
+		goto exit;
+	}
+	memset(burst, CMD_NOP, burst_len);
 
+	uint64_t start = TimeUs();
+	uint64_t deadline = start + (uint64_t)opt_discovery_s * 1000000;
+	long sent = 0;
 	for (;;)
 	{
-		sp_blocking_write(port, &nop, 1, 10);
-		sp_drain(port);
-		sp_flush(port, SP_BUF_BOTH);
+		if (opt_discovery_s && (TimeUs() >= deadline))
+			goto exit;
 
-		if (sp_blocking_read(port, &res, 1, 10) == SP_OK)
+		// top up the NOPs waiting to be sent, adapters that can't report it get one burst per wait
+		int waiting = sp_output_waiting(s->port);
+		if (waiting < 0)
+			waiting = 0;
+		if (waiting < burst_len)
 		{
-			if (res == 'A')
-				return;
+			int res = sp_nonblocking_write(s->port, burst, burst_len - waiting);
+			if (res > 0)
+				sent += res;
 		}
+
+		sp_wait(events, DISCOVERY_BURST_MS);
+		uint8_t buffer[64];
+		int res;
+		while ((res = sp_nonblocking_read(s->port, buffer, sizeof(buffer))) > 0)
+		{
+			if (memchr(buffer, RES_OK, res) != NULL)
+			{
+				found = true;
+				break;
+			}
+		}
+		if (found)
+			break;
 	}
+
+	SessionPrintf(s, "Bootloader found after %.1f ms, %ld NOPs sent.\n", (TimeUs() - start) / 1000.0, sent);
+
+exit:
+	if (events != NULL)
+		sp_free_event_set(events);
+	free(burst);
+	return found;
 }
 
 /**************************************************************************************************
-* Bootloader command
+* Confirm a new baud rate. Each attempt sends a NOP, which the bootloader only accepts while it is
+* still waiting for confirmation, then a version request, which only its main loop answers. The
+* request waits for the NOP's response so that it doesn't arrive while the bootloader is driving
+* the bus. A version without a NOP response means an earlier confirmation's response was lost and
+* the bootloader had already switched. Either way it is now running at the new rate.
 */
-bool Command(char *cmd, int len)
+bool ConfirmBaud(SESSION_t *s, int attempts)
 {
-	// clear buffers
-	if (check(sp_flush(port, SP_BUF_BOTH)) != SP_OK)
+	char cmd;
+	uint8_t res[2];
+
+	while (attempts--)
 	{
-		printf("sp_flush() failed.\n");
-		return false;
+		sp_flush(s->port, SP_BUF_BOTH);
+		cmd = CMD_NOP;
+		if (sp_blocking_write(s->port, &cmd, 1, WriteTimeout(s, 1)) != 1)
+			continue;
+		bool confirmed = (sp_blocking_read(s->port, res, 1, BAUD_CONFIRM_TIMEOUT_MS) == 1) && (res[0] == RES_OK);
+
+		cmd = CMD_READ_BOOTLOADER_VERSION;
+		if ((sp_blocking_write(s->port, &cmd, 1, WriteTimeout(s, 1)) != 1) ||
+			(sp_blocking_read(s->port, res, 2, BAUD_CONFIRM_TIMEOUT_MS) != 2) || (res[0] != RES_OK))
+			continue;
+
+		// the NOP's response arrived after its timeout, the version follows it
+		if (!confirmed && (res[1] == RES_OK))
+		{
+			if (sp_blocking_read(s->port, &res[1], 1, BAUD_CONFIRM_TIMEOUT_MS) != 1)
+				continue;
+			confirmed = true;
+		}
+		s->version = res[1];
+		if (!confirmed)
+			SessionPrintf(s, "(confirmed earlier) ");
+		return true;
 	}
+	return false;
+}
 
-	// set up page write
-	if (check(sp_blocking_write(port, cmd, len, DEFAULT_TIMEOUT_MS)) != len)
+/**************************************************************************************************
+* Check the bootloader is answering at DEFAULT_BAUD after falling back. The main loop ignores NOPs,
+* so it is asked for its version instead.
+*/
+bool PingDefaultBaud(SESSION_t *s, int attempts)
+{
+	char cmd = CMD_READ_BOOTLOADER_VERSION;
+	uint8_t res[2];
+
+	while (attempts--)
 	{
-		printf("sp_blocking_write() failed.\n");
-		return false;
+		sp_flush(s->port, SP_BUF_BOTH);
+		if (sp_blocking_write(s->port, &cmd, 1, WriteTimeout(s, 1)) != 1)
+			continue;
+		if ((sp_blocking_read(s->port, res, 2, ResponseTimeout(s, 1, 2, 0)) == 2) && (res[0] == RES_OK))
+			return true;
 	}
+	return false;
+}
 
-	// check response
-	char res;
-	if (check(sp_blocking_read(port, &res, 1, DEFAULT_TIMEOUT_MS)) != 1)
+/**************************************************************************************************
+* Switch the bootloader and port to a faster baud rate, staying at DEFAULT_BAUD if that fails. Only
+* false if the bootloader stops answering.
+*/
+bool NegotiateBaud(SESSION_t *s, int baud)
+{
+	char cmd[3];
+	cmd[0] = CMD_SET_BAUD;
+	cmd[1] = ((baud / 100) >> 8) & 0xFF;
+	cmd[2] = (baud / 100) & 0xFF;
+
+	SessionPrintf(s, "Switching to %d baud... ", baud);
+	if (!Command(s, cmd, 3))
 	{
-		printf("sp_blocking_read() failed.\n");
-		return false;
+		SessionPrintf(s, "Rate not supported by bootloader, staying at %d.\n", DEFAULT_BAUD);
+		return true;
 	}
-	if (res != 'A')
+
+	// bootloader waits about 500ms for a NOP at the new rate before reverting
+	sp_drain(s->port);
+	if ((check(sp_set_baudrate(s->port, baud)) == SP_OK) &&
+		ConfirmBaud(s, 3))
 	{
-		printf("Bad response '%c'\n", res);
-		return false;
+		s->baud = baud;
+		SessionPrintf(s, "OK.\n");
+		return true;
 	}
+
+	SessionPrintf(s, "failed, staying at %d.\n", DEFAULT_BAUD);
+	check(sp_set_baudrate(s->port, DEFAULT_BAUD));
+	sp_blocking_read(s->port, cmd, sizeof(cmd), BAUD_FALLBACK_MS);	// let the bootloader time out
+	return PingDefaultBaud(s, 3);
 }
 
 /**************************************************************************************************
-* Write loaded firmware image to target
+* Time to send bytes at the session's baud rate, 8N1
 */
-void UpdateFirmware(void)
+int64_t WireUs(SESSION_t *s, int bytes)
 {
-	int num_pages = fw_info->flash_size_b / fw_info->page_size_b;
-	printf("Total pages:\t%d\n", num_pages);
-
-	// erase app section
-	printf("Erasing application section...\n");
-	if (!Command("!", 1))
-		return;
+	return ((int64_t)bytes * 10 * 1000000) / s->baud;
+}
 
-	// write app section
-	printf("Writing firmware image...\n");
-	for (int page = 0; page < num_pages; page++)
+/**************************************************************************************************
+* Timeout for a response of rx bytes to a request of tx bytes that keeps the bootloader busy for up
+* to device_ms. The turnaround is estimated from measured responses as TCP does for its RTO, so a
+* dead device is detected quickly on a fast link.
+*/
+unsigned int ResponseTimeout(SESSION_t *s, int tx, int rx, int device_ms)
+{
+	int64_t turnaround_us = DEFAULT_TIMEOUT_MS * 1000;
+	if (s->rtt_samples > 0)
 	{
-		printf("Page %u of %u (%u%%)\n", page, num_pages, (page*100)/num_pages);
-
-		// clear buffers
-		if (check(sp_flush(port, SP_BUF_BOTH)) != SP_OK)
-			return;
-
-		// set up page write
-		char cmd[3];
-		cmd[0] = 'W';
-		cmd[1] = (page >> 8) & 0xFF;
-		cmd[2] = page & 0xFF;
-		if (!Command(cmd, 3))
-			return;
+		turnaround_us = s->srtt_us + 4 * s->rttvar_us;
+		if (turnaround_us < MIN_TIMEOUT_MS * 1000)
+			turnaround_us = MIN_TIMEOUT_MS * 1000;
+	}
+	return (unsigned int)((WireUs(s, tx + rx) + turnaround_us) / 1000) + device_ms + 1;
+}
 
-		// send page data
-		if (check(sp_blocking_write(port, &firmware_buffer[page * fw_info->page_size_b], fw_info->page_size_b, DEFAULT_TIMEOUT_MS)) != fw_info->page_size_b)
-		{
-			printf("sp_blocking_write() failed when writing firmware image.\n");
-			return;
-		}
+// writes only block while the OS and adapter buffers are full
+unsigned int WriteTimeout(SESSION_t *s, int len)
+{
+	return (unsigned int)((2 * WireUs(s, len)) / 1000) + MIN_TIMEOUT_MS;
+}
 
-		// check response
-		char res;
-		if (check(sp_blocking_read(port, &res, 1, DEFAULT_TIMEOUT_MS)) != 1)
-			return;
-		if (res != 'A')
-		{
-			printf("Bad response '%c'\n", res);
-			return;
-		}
+/**************************************************************************************************
+* Update the turnaround estimate with a measured response
+*/
+void RttSample(SESSION_t *s, int64_t rtt_us)
+{
+	if (rtt_us < 0)
+		rtt_us = 0;
+	if (s->rtt_samples++ == 0)
+	{
+		s->srtt_us = rtt_us;
+		s->rttvar_us = rtt_us / 2;
+		return;
 	}
+	int64_t err = rtt_us - s->srtt_us;
+	s->rttvar_us += ((err < 0 ? -err : err) - s->rttvar_us) / 4;
+	s->srtt_us += err / 8;
+}
 
-	Command('#', 1);	// reset MCU
-	
-	// todo: check CRC
+/**************************************************************************************************
+* Read a response of len bytes to a request of sent bytes, logging how long it took to arrive.
+* Responses to a request that don't wait on the NVM controller update the turnaround estimate,
+* sent is 0 when reading the rest of a response.
+*/
+int ReadResponse(SESSION_t *s, void *buf, int len, int sent, int device_ms)
+{
+	uint64_t start = TimeUs();
+	int res = sp_blocking_read(s->port, buf, len, ResponseTimeout(s, sent, len, device_ms));
+	if (res == len)
+	{
+		uint64_t wait = TimeUs() - start;
+		HistogramAdd(&s->timing.ack_wait, wait);
+		if ((sent > 0) && (device_ms == 0))
+			RttSample(s, (int64_t)wait - WireUs(s, sent + len));
+	}
+	return res;
+}
 
-	return;
+/**************************************************************************************************
+* Worst case time the bootloader takes to acknowledge a command
+*/
+int CommandDeviceMs(char cmd)
+{
+	switch (cmd)
+	{
+		case CMD_ERASE_APP_SECTION:
+			return APP_SECTION_ERASE_TIMEOUT_MS;
+		case CMD_ERASE_PAGE:
+			return PAGE_NVM_TIMEOUT_MS;
+		case CMD_READ_FLASH_CRCS:
+			return PAGE_NVM_TIMEOUT_MS + (fw_info->flash_size_b / 1024 + 8) * NVM_CRC_MS_PER_KB;		// boot section too
+		default:
+			return 0;		// may wait for a page write, which the margin covers
+	}
 }
 
 /**************************************************************************************************
-* Check device serial number, MCU ID and fuses
+* Set how long the bootloader waits before driving the bus to respond, every node with -m
 */
-bool GetBootloaderInfo(void)
+bool SetTurnaround(SESSION_t *s, int us)
 {
-#if 0
-	uint8_t buffer[BUFFER_SIZE];
+	char cmd[3];
+	cmd[0] = CMD_SET_TURNAROUND;
+	cmd[1] = (us >> 8) & 0xFF;
+	cmd[2] = us & 0xFF;
 
-	// serial number
-	if (!ExecuteHIDCommand(handle, CMD_READ_SERIAL, 0, DEFAULT_TIMEOUT, buffer))
-		return false;
-	buffer[BUFFER_SIZE - 1] = '\0';		// ensure string is null terminated
-	printf("Serial:\t\t%s\n", &buffer[3]);
+	if (num_nodes > 0)
+		return BroadcastCommand(s, cmd, 3);
 
-	// MCU ID
-	if (!ExecuteHIDCommand(handle, CMD_READ_MCU_IDS, 0, DEFAULT_TIMEOUT, buffer))
+	SessionPrintf(s, "Turnaround %d us.\n", us);
+	if (!Command(s, cmd, 3))
 		return false;
-	target_mcu_id[0] = buffer[3];
-	target_mcu_id[1] = buffer[4];
-	target_mcu_id[2] = buffer[5];
-	target_mcu_id[3] = buffer[6];
-	printf("MCU ID:\t\t%02X%02X%02X-%c\n", target_mcu_id[0], target_mcu_id[1], target_mcu_id[2], target_mcu_id[3] + 'A');
-
-	// MCU fuses
-	if (!ExecuteHIDCommand(handle, CMD_READ_MCU_IDS, 0, DEFAULT_TIMEOUT, buffer))
+	s->rtt_samples = 0;		// measured with the old turnaround
+	return true;
+}
+
+/**************************************************************************************************
+* Bootloader command
+*/
+bool Command(SESSION_t *s, char *cmd, int len)
+{
+	// clear buffers
+	if (check(sp_flush(s->port, SP_BUF_BOTH)) != SP_OK)
+	{
+		SessionPrintf(s, "sp_flush() failed.\n");
 		return false;
-	target_mcu_fuses[0] = buffer[3];
-	target_mcu_fuses[1] = buffer[4];
-	target_mcu_fuses[2] = buffer[5];
-	target_mcu_fuses[3] = buffer[6];
-	target_mcu_fuses[4] = buffer[7];
-	target_mcu_fuses[5] = buffer[8];
-	printf("MCU fuses:\t%02X %02X %02X %02X %02X %02X\n", target_mcu_fuses[0], target_mcu_fuses[1], target_mcu_fuses[2], target_mcu_fuses[3], target_mcu_fuses[4], target_mcu_fuses[5]);
+	}
+
+	// set up page write
+	if (check(sp_blocking_write(s->port, cmd, len, WriteTimeout(s, len))) != len)
+	{
+		SessionPrintf(s, "sp_blocking_write() failed.\n");
+		return false;
+	}
+
+	// check response
+	char res;
+	if (check(ReadResponse(s, &res, 1, len, CommandDeviceMs(cmd[0]))) != 1)
+	{
+		SessionPrintf(s, "sp_blocking_read() failed.\n");
+		return false;
+	}
+	if (res != 'A')
+	{
+		SessionPrintf(s, "Bad response '%c'\n", res);
+		return false;
+	}
 
-#endif
 	return true;
 }
+
+/**************************************************************************************************
+* Send a complete frame with a single response, resending it if the response is bad or missing.
+* There is no buffer flushing unless the frame has to be resent.
+*/
+bool SendFrame(SESSION_t *s, uint8_t *frame, int len, int page)
+{
+	for (int attempt = 0; attempt < FRAME_RETRIES; attempt++)
+	{
+		if (attempt > 0)
+		{
+			s->timing.resends++;
+			SessionPrintf(s, "Resending page %d.\n", page);
+			ResyncFrames(s, len);
+		}
+
+		if (check(sp_blocking_write(s->port, frame, len, WriteTimeout(s, len))) != len)
+		{
+			SessionPrintf(s, "sp_blocking_write() failed when writing firmware image.\n");
+			return false;
+		}
+
+		// the bootloader loads the page into the NVM buffer before acknowledging
+		char res;
+		if ((ReadResponse(s, &res, 1, len, PAGE_NVM_TIMEOUT_MS) == 1) && (res == RES_OK))
+			return true;
+	}
+
+	SessionPrintf(s, "Page %d failed after %d attempts.\n", page, FRAME_RETRIES);
+	return false;
+}
+
+/**************************************************************************************************
+* Write one page as a single frame: command, page number, data and CRC16
+*/
+bool WritePageFramed(SESSION_t *s, int page)
+{
+	uint8_t *frame = s->frame;
+	int len = 3 + fw_info->page_size_b + 2;
+
+	frame[0] = CMD_WRITE_PAGE_FRAMED;
+	frame[1] = (page >> 8) & 0xFF;
+	frame[2] = page & 0xFF;
+	memcpy(&frame[3], &firmware_buffer[page * fw_info->page_size_b], fw_info->page_size_b);
+	uint16_t crc = crc16_xmodem(0, &frame[1], len - 3);
+	frame[len - 2] = (crc >> 8) & 0xFF;
+	frame[len - 1] = crc & 0xFF;
+
+	return SendFrame(s, frame, len, page);
+}
+
+/**************************************************************************************************
+* Write one page compressed: command, page number, compressed length, data and CRC16. Pages that
+* don't get smaller are sent uncompressed.
+*/
+bool WritePageCompressed(SESSION_t *s, int page)
+{
+	uint8_t *frame = s->frame;
+	int page_size = fw_info->page_size_b;
+
+	s->uncompressed_bytes += 3 + page_size + 2;
+	int compressed_len = CompressPage(&firmware_buffer[page * page_size], page_size, &frame[5], page_size - 1);
+	if (compressed_len < 0)
+	{
+		s->compressed_bytes += 3 + page_size + 2;
+		return WritePageFramed(s, page);
+	}
+
+	int len = 5 + compressed_len + 2;
+	frame[0] = CMD_WRITE_PAGE_COMPRESSED;
+	frame[1] = (page >> 8) & 0xFF;
+	frame[2] = page & 0xFF;
+	frame[3] = (compressed_len >> 8) & 0xFF;
+	frame[4] = compressed_len & 0xFF;
+	uint16_t crc = crc16_xmodem(0, &frame[1], len - 3);
+	frame[len - 2] = (crc >> 8) & 0xFF;
+	frame[len - 1] = crc & 0xFF;
+	s->compressed_bytes += len;
+
+	return SendFrame(s, frame, len, page);
+}
+
+/**************************************************************************************************
+* Complete any partially received frame with NOPs and discard responses, so that the next command
+* isn't misinterpreted. The bootloader ignores the excess NOPs.
+*/
+void ResyncFrames(SESSION_t *s, int len)
+{
+	uint8_t *pad = malloc(len);
+	if (pad == NULL)
+		return;
+	memset(pad, CMD_NOP, len);
+	sp_blocking_write(s->port, pad, len, WriteTimeout(s, len));
+	sp_drain(s->port);
+
+	// the padding may still be in the adapter, the resent frame must not get queued behind it
+	unsigned int timeout = ResponseTimeout(s, len, 0, 0);
+	if (timeout < FRAME_RESYNC_MS)
+		timeout = FRAME_RESYNC_MS;
+	sp_blocking_read(s->port, pad, len, timeout);
+	free(pad);
+	sp_flush(s->port, SP_BUF_BOTH);
+}
+
+/**************************************************************************************************
+* Number of NOPs to follow each windowed frame with. Frames can't arrive faster than pages are
+* written, and there are always at least WINDOW_GAP_US of them. Bootloaders before version 3 lose
+* anything sent while they load the page into the NVM buffer, and a frame that lost bytes on the
+* wire takes its last bytes from the NOPs instead of from the next frame, whose data would
+* otherwise be run as commands.
+*/
+int WindowGap(SESSION_t *s, int frame_len)
+{
+	int64_t gap_us = PAGE_WRITE_US - WireUs(s, frame_len);
+	if (gap_us < WINDOW_GAP_US)
+		gap_us = WINDOW_GAP_US;
+	return (int)((gap_us * s->baud) / (10 * 1000000)) + 1;
+}
+
+/**************************************************************************************************
+* Build a CMD_WRITE_PAGE_WINDOWED frame followed by gap NOPs, returns the length
+*/
+int BuildWindowedFrame(uint8_t *p, uint8_t seq, int page, int gap)
+{
+	int page_size = fw_info->page_size_b;
+	int frame_len = 4 + page_size + 2;
+
+	p[0] = CMD_WRITE_PAGE_WINDOWED;
+	p[1] = seq;
+	p[2] = (page >> 8) & 0xFF;
+	p[3] = page & 0xFF;
+	memcpy(&p[4], &firmware_buffer[page * page_size], page_size);
+	uint16_t crc = crc16_xmodem(0, &p[1], 3 + page_size);
+	p[frame_len - 2] = (crc >> 8) & 0xFF;
+	p[frame_len - 1] = crc & 0xFF;
+	memset(&p[frame_len], CMD_NOP, gap);
+	return frame_len + gap;
+}
+
+/**************************************************************************************************
+* Write a list of pages with a sliding window. Up to opt_window frames are sent back to back with no
+* response, then CMD_WINDOW_STATUS returns a bitmap of sequence numbers that were not received
+* intact. Those pages are resent at the start of the next window. Rewriting a page that did arrive
+* is harmless because the data is the same.
+*/
+bool WritePagesWindowed(SESSION_t *s, int *pages, int count)
+{
+	int page_size = fw_info->page_size_b;
+	int frame_len = 4 + page_size + 2;
+	int gap = WindowGap(s, frame_len);
+	int *retries = calloc(count, sizeof(int));
+	int *queue = malloc(count * sizeof(int));
+	uint8_t *buffer = malloc(opt_window * (frame_len + gap));
+	bool result = false;
+	if ((retries == NULL) || (queue == NULL) || (buffer == NULL))
+	{
+		SessionPrintf(s, "Out of memory.\n");
+		goto exit;
+	}
+
+	// queue holds indexes into pages[], resent pages go to the front
+	int queued = 0;
+	int next = 0;
+	uint8_t seq = 0;
+	while ((queued > 0) || (next < count))
+	{
+		int window[WINDOW_MAX_FRAMES];
+		int n = 0;
+		while ((n < opt_window) && (queued > 0))
+			window[n++] = queue[--queued];
+		while ((n < opt_window) && (next < count))
+			window[n++] = next++;
+		if (num_sessions == 1)
+			SessionPrintf(s, "Window of %d pages, %d of %d sent (%d%%)\n", n, next, count, (next * 100) / count);
+
+		uint64_t window_start = TimeUs();
+		uint8_t *p = buffer;
+		uint8_t first_seq = seq;
+		for (int i = 0; i < n; i++)
+			p += BuildWindowedFrame(p, seq++, pages[window[i]], gap);
+
+		// the adapter may still be sending when the write returns, the status timeout allows for the whole window
+		int len = p - buffer;
+		if (check(sp_blocking_write(s->port, buffer, len, WriteTimeout(s, len))) != len)
+		{
+			SessionPrintf(s, "sp_blocking_write() failed when writing firmware image.\n");
+			goto exit;
+		}
+
+		// a lost status response means every frame in the window is resent
+		uint32_t naks = 0xFFFFFFFF;
+		uint8_t status[5];
+		char cmd = CMD_WINDOW_STATUS;
+		if ((sp_blocking_write(s->port, &cmd, 1, WriteTimeout(s, 1)) == 1) &&
+			(ReadResponse(s, status, sizeof(status), len + 1, PAGE_NVM_TIMEOUT_MS) == sizeof(status)) &&
+			(status[0] == RES_OK))
+			naks = status[1] | (status[2] << 8) | (status[3] << 16) | ((uint32_t)status[4] << 24);
+		else
+			ResyncFrames(s, frame_len);
+
+		uint64_t per_page = (TimeUs() - window_start) / n;
+		for (int i = 0; i < n; i++)
+			TimingPage(&s->timing, pages[window[i]], window_start + i * per_page, window_start + (i + 1) * per_page);
+
+		for (int i = n - 1; i >= 0; i--)
+		{
+			if (!(naks & (1UL << ((uint8_t)(first_seq + i) % WINDOW_MAX_FRAMES))))
+				continue;
+			if (++retries[window[i]] >= FRAME_RETRIES)
+			{
+				SessionPrintf(s, "Page %d failed after %d attempts.\n", pages[window[i]], FRAME_RETRIES);
+				goto exit;
+			}
+			SessionPrintf(s, "Resending page %d.\n", pages[window[i]]);
+			s->timing.resends++;
+			queue[queued++] = window[i];
+		}
+	}
+	result = true;
+
+exit:
+	free(retries);
+	free(queue);
+	free(buffer);
+	return result;
+}
+
+/**************************************************************************************************
+* Write one page of the loaded image
+*/
+bool WritePage(SESSION_t *s, int page)
+{
+	if (opt_compressed)
+		return WritePageCompressed(s, page);
+	if (opt_framed)
+		return WritePageFramed(s, page);
+
+	// set up page write
+	char cmd[3];
+	cmd[0] = opt_pipelined ? CMD_WRITE_PAGE_PIPELINED : CMD_WRITE_PAGE;
+	cmd[1] = (page >> 8) & 0xFF;
+	cmd[2] = page & 0xFF;
+	if (!Command(s, cmd, 3))
+		return false;
+
+	// send page data
+	if (check(sp_blocking_write(s->port, &firmware_buffer[page * fw_info->page_size_b], fw_info->page_size_b, WriteTimeout(s, fw_info->page_size_b))) != fw_info->page_size_b)
+	{
+		SessionPrintf(s, "sp_blocking_write() failed when writing firmware image.\n");
+		return false;
+	}
+
+	// check response
+	char res;
+	if (check(ReadResponse(s, &res, 1, fw_info->page_size_b, PAGE_NVM_TIMEOUT_MS)) != 1)
+	{
+		SessionPrintf(s, "sp_blocking_read() failed.\n");
+		return false;
+	}
+	if (res != 'A')
+	{
+		SessionPrintf(s, "Bad response '%c'\n", res);
+		return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Read the NVM controller CRCs of a range of application section pages
+*/
+bool ReadPageCRCs(SESSION_t *s, int first_page, int count, uint32_t *crcs)
+{
+	char cmd[5];
+	cmd[0] = CMD_READ_PAGE_CRCS;
+	cmd[1] = (first_page >> 8) & 0xFF;
+	cmd[2] = first_page & 0xFF;
+	cmd[3] = (count >> 8) & 0xFF;
+	cmd[4] = count & 0xFF;
+	if (!Command(s, cmd, 5))
+		return false;
+
+	uint8_t buffer[PAGE_CRCS_PER_REQUEST * 3];
+	int crc_ms = ((count * fw_info->page_size_b) / 1024 + 1) * NVM_CRC_MS_PER_KB;
+	if (check(ReadResponse(s, buffer, count * 3, 0, crc_ms)) != count * 3)
+	{
+		SessionPrintf(s, "sp_blocking_read() failed.\n");
+		return false;
+	}
+	for (int i = 0; i < count; i++)
+		crcs[i] = buffer[i * 3] | (buffer[(i * 3) + 1] << 8) | (buffer[(i * 3) + 2] << 16);
+	return true;
+}
+
+/**************************************************************************************************
+* Compare the device's page CRCs with the loaded image, and mark pages that need to be erased and
+* rewritten. Returns the number of marked pages, or -1 on error.
+*/
+int FindChangedPages(SESSION_t *s, int num_pages, uint8_t *page_actions)
+{
+	int changed = 0;
+	uint32_t crcs[PAGE_CRCS_PER_REQUEST];
+
+	SessionPrintf(s, "Reading page CRCs...\n");
+	for (int first = 0; first < num_pages; first += PAGE_CRCS_PER_REQUEST)
+	{
+		int count = num_pages - first;
+		if (count > PAGE_CRCS_PER_REQUEST)
+			count = PAGE_CRCS_PER_REQUEST;
+		if (!ReadPageCRCs(s, first, count, crcs))
+			return -1;
+
+		for (int i = 0; i < count; i++)
+		{
+			int page = first + i;
+			uint32_t crc = xmega_nvm_crc32(&firmware_buffer[page * fw_info->page_size_b], fw_info->page_size_b);
+			if (crc == crcs[i])
+				continue;
+			page_actions[page] = PAGE_ERASE;
+			if (PagePopulated(page, fw_info->page_size_b))
+				page_actions[page] |= PAGE_WRITE;
+			changed++;
+		}
+	}
+	return changed;
+}
+
+/**************************************************************************************************
+* Erase and write pages as marked in page_actions
+*/
+bool ApplyPageActions(SESSION_t *s, uint8_t *page_actions, int num_pages, int num_actions)
+{
+	int *window_pages = malloc(num_pages * sizeof(int));
+	int num_window_pages = 0;
+	bool result = false;
+	if (window_pages == NULL)
+	{
+		SessionPrintf(s, "Out of memory.\n");
+		return false;
+	}
+
+	// write app section
+	// In pipelined mode the bootloader acknowledges each page as soon as it starts programming it,
+	// and receives the next page while the flash write is in progress.
+	SessionPrintf(s, "Writing firmware image...\n");
+	int done = 0;
+	for (int page = 0; page < num_pages; page++)
+	{
+		if (page_actions[page] == 0)
+			continue;
+		if (!opt_window && (num_sessions == 1))		// too much output for many ports
+			SessionPrintf(s, "Page %u of %u (%u%%)\n", page, num_pages, (done*100)/num_actions);
+		done++;
+
+		uint64_t page_start = TimeUs();
+		if (page_actions[page] & PAGE_ERASE)
+		{
+			char cmd[3];
+			cmd[0] = CMD_ERASE_PAGE;
+			cmd[1] = (page >> 8) & 0xFF;
+			cmd[2] = page & 0xFF;
+			if (!Command(s, cmd, 3))
+				goto exit;
+		}
+
+		if (page_actions[page] & PAGE_WRITE)
+		{
+			if (opt_window)
+				window_pages[num_window_pages++] = page;		// written after all erases are done
+			else if (!WritePage(s, page))
+				goto exit;
+		}
+		if (!opt_window)
+			TimingPage(&s->timing, page, page_start, TimeUs());
+	}
+
+	if (opt_window)
+	{
+		if (!WritePagesWindowed(s, window_pages, num_window_pages))
+			goto exit;
+	}
+
+	result = true;
+
+exit:
+	free(window_pages);
+	return result;
+}
+
+/**************************************************************************************************
+* Write loaded firmware image to target
+*/
+bool UpdateFirmware(SESSION_t *s)
+{
+	if (s->has_info && !CheckDeviceInfo(s))
+		return false;
+
+	int num_pages = fw_info->flash_size_b / fw_info->page_size_b;
+	SessionPrintf(s, "Total pages:\t%d\n", num_pages);
+
+	bool result = false;
+	uint8_t *page_actions = calloc(num_pages, 1);
+	if (page_actions == NULL)
+	{
+		SessionPrintf(s, "Out of memory.\n");
+		return false;
+	}
+
+	int num_actions = 0;
+	if (opt_differential)
+	{
+		// only erase and rewrite pages that are different on the device
+		TimingPhase(&s->timing, PHASE_COMPARE);
+		num_actions = FindChangedPages(s, num_pages, page_actions);
+		if (num_actions < 0)
+			goto exit;
+		SessionPrintf(s, "Changed pages:\t%d\n", num_actions);
+
+		// version 5+ erase each page as they write it, saving a command per page
+		if ((s->version >= 5) && (num_actions > 0))
+		{
+			char cmd[2] = { CMD_ERASE_ON_WRITE, 1 };
+			if (!Command(s, cmd, 2))
+				goto exit;
+			for (int page = 0; page < num_pages; page++)
+			{
+				if (page_actions[page] & PAGE_WRITE)
+					page_actions[page] &= ~PAGE_ERASE;
+			}
+		}
+	}
+	else
+	{
+		// pages that are all 0xFF are left blank by the erase
+		for (int page = 0; page < num_pages; page++)
+		{
+			if (PagePopulated(page, fw_info->page_size_b))
+			{
+				page_actions[page] = PAGE_WRITE;
+				num_actions++;
+			}
+		}
+		SessionPrintf(s, "Used pages:\t%d\n", num_actions);
+
+		// erase app section
+		TimingPhase(&s->timing, PHASE_ERASE);
+		SessionPrintf(s, "Erasing application section...\n");
+		if (!Command(s, "!", 1))
+			goto exit;
+	}
+
+	TimingPhase(&s->timing, PHASE_WRITE);
+	if (!ApplyPageActions(s, page_actions, num_pages, num_actions))
+		goto exit;
+
+	if (opt_compressed && (s->uncompressed_bytes > 0))
+		SessionPrintf(s, "Compressed:\t%ld of %ld bytes sent (%ld%%)\n", s->compressed_bytes, s->uncompressed_bytes, (s->compressed_bytes * 100) / s->uncompressed_bytes);
+
+	TimingPhase(&s->timing, PHASE_VERIFY);
+	if (!VerifyFirmware(s))
+		goto exit;
+
+	if (opt_timing && (s->version >= 4))
+		ReadCycleStats(s);
+
+	TimingPhase(&s->timing, PHASE_RESET);
+	Command(s, "#", 1);	// reset MCU
+	SessionPrintf(s, (num_sessions > 1) ? "Firmware update complete.\n" : "\nFirmware update complete.\n");
+	result = true;
+
+exit:
+	free(page_actions);
+	return result;
+}
+
+/**************************************************************************************************
+* Save the application section to hexfile, raw if the name ends in .bin. CMD_READ_PAGES streams
+* every page back to back with its CRC16. A bad or missing page restarts the stream from that page,
+* once the bootloader has finished sending the rest and will listen again. The device is left in the
+* bootloader, ready for an update.
+*/
+bool DumpFirmware(SESSION_t *s)
+{
+	if (s->version < 6)
+	{
+		SessionPrintf(s, "Bootloader version %d can't stream flash, version 6+ needed.\n", s->version);
+		return false;
+	}
+
+	int page_size = s->info.app_page_size;
+	uint32_t app_size = s->info.app_size;
+	if (!s->has_info)
+	{
+		uint8_t sizes[24];
+		if (!Command(s, "m", 1) ||
+			(check(ReadResponse(s, sizes, sizeof(sizes), 0, 0)) != sizeof(sizes)))
+		{
+			SessionPrintf(s, "Unable to read memory sizes.\n");
+			return false;
+		}
+		page_size = sizes[0] | (sizes[1] << 8) | (sizes[2] << 16) | ((uint32_t)sizes[3] << 24);
+		app_size = sizes[4] | (sizes[5] << 8) | (sizes[6] << 16) | ((uint32_t)sizes[7] << 24);
+	}
+	if ((page_size <= 0) || (app_size > FIRMWARE_BUFFER_SIZE) || (app_size % page_size))
+	{
+		SessionPrintf(s, "Bad memory sizes response.\n");
+		return false;
+	}
+	int num_pages = app_size / page_size;
+	SessionPrintf(s, "Reading %d pages of %d bytes...\n", num_pages, page_size);
+
+	TimingPhase(&s->timing, PHASE_READ);
+	bool result = false;
+	uint8_t *buffer = malloc(page_size + 2);
+	if (buffer == NULL)
+	{
+		SessionPrintf(s, "Out of memory.\n");
+		return false;
+	}
+	memset(firmware_buffer, 0xFF, app_size);
+
+	int page = 0;
+	int attempts = 0;
+	while (page < num_pages)
+	{
+		char cmd[5];
+		cmd[0] = CMD_READ_PAGES;
+		cmd[1] = (page >> 8) & 0xFF;
+		cmd[2] = page & 0xFF;
+		cmd[3] = ((num_pages - page) >> 8) & 0xFF;
+		cmd[4] = (num_pages - page) & 0xFF;
+		if (!Command(s, cmd, 5))
+			goto exit;
+
+		for (; page < num_pages; page++)
+		{
+			if (sp_blocking_read(s->port, buffer, page_size + 2, ResponseTimeout(s, 0, page_size + 2, 0)) != page_size + 2)
+				break;
+			uint16_t crc = buffer[page_size] | (buffer[page_size + 1] << 8);
+			if (crc16_xmodem(0, buffer, page_size) != crc)
+				break;
+			memcpy(&firmware_buffer[page * page_size], buffer, page_size);
+		}
+		if (page >= num_pages)
+			break;
+
+		if (++attempts >= FRAME_RETRIES)
+		{
+			SessionPrintf(s, "Page %d failed after %d attempts.\n", page, FRAME_RETRIES);
+			goto exit;
+		}
+		SessionPrintf(s, "Rereading from page %d.\n", page);
+		s->timing.resends++;
+		while (sp_blocking_read(s->port, buffer, page_size + 2, ResponseTimeout(s, 0, page_size + 2, 0)) > 0)
+			;
+	}
+
+	const char *ext = strrchr(hexfile, '.');
+	if ((ext != NULL) && ((strcmp(ext, ".bin") == 0) || (strcmp(ext, ".BIN") == 0)))
+	{
+		FILE *fp = fopen(hexfile, "wb");
+		if (fp == NULL)
+		{
+			SessionPrintf(s, "Unable to create %s.\n", hexfile);
+			goto exit;
+		}
+		bool written = (fwrite(firmware_buffer, 1, app_size, fp) == app_size);
+		if ((fclose(fp) != 0) || !written)
+		{
+			SessionPrintf(s, "Unable to write %s.\n", hexfile);
+			goto exit;
+		}
+	}
+	else if (!WriteHexFile(hexfile, firmware_buffer, app_size))
+		goto exit;
+	SessionPrintf(s, "Saved %u bytes to %s.\n", app_size, hexfile);
+	result = true;
+
+exit:
+	free(buffer);
+	return result;
+}
+
+/**************************************************************************************************
+* Read the device serial number, its node address for RS485 broadcast
+*/
+bool ReadSerial(SESSION_t *s, uint8_t *serial)
+{
+	if (!Command(s, "s", 1))
+		return false;
+
+	// version 2 bootloaders send NODE_SERIAL_LENGTH bytes, version 1 sent a shorter serial
+	uint8_t buffer[2 + NODE_SERIAL_LENGTH];
+	if (check(ReadResponse(s, buffer, 2, 0, 0)) != 2)
+	{
+		SessionPrintf(s, "sp_blocking_read() failed.\n");
+		return false;
+	}
+	int len = buffer[0] | (buffer[1] << 8);
+	if ((len > NODE_SERIAL_LENGTH) ||
+		(check(ReadResponse(s, serial, len, 0, 0)) != len))
+	{
+		SessionPrintf(s, "Bad serial number response.\n");
+		return false;
+	}
+	memset(&serial[len], 0, NODE_SERIAL_LENGTH - len);
+	return true;
+}
+
+/**************************************************************************************************
+* Read the bootloader version into the session
+*/
+bool ReadVersion(SESSION_t *s)
+{
+	if (!Command(s, "v", 1))
+		return false;
+
+	uint8_t version;
+	if (check(ReadResponse(s, &version, 1, 0, 0)) != 1)
+	{
+		SessionPrintf(s, "sp_blocking_read() failed.\n");
+		return false;
+	}
+	s->version = version;
+	return true;
+}
+
+/**************************************************************************************************
+* Read how many CPU cycles the bootloader spent receiving pages. Only bootloaders built with
+* BL_CYCLE_STATS count them, others fail the command.
+*/
+void ReadCycleStats(SESSION_t *s)
+{
+	char cmd = CMD_READ_CYCLE_STATS;
+	uint8_t buffer[1 + 16];
+	if ((check(sp_flush(s->port, SP_BUF_BOTH)) != SP_OK) ||
+		(check(sp_blocking_write(s->port, &cmd, 1, WriteTimeout(s, 1))) != 1) ||
+		(check(ReadResponse(s, buffer, 1, 1, 0)) != 1) ||
+		(buffer[0] != RES_OK) ||
+		(check(ReadResponse(s, &buffer[1], 16, 0, 0)) != 16))
+		return;
+
+	uint32_t values[4];
+	for (int i = 0; i < 4; i++)
+		values[i] = buffer[1 + i * 4] | (buffer[2 + i * 4] << 8) | (buffer[3 + i * 4] << 16) | ((uint32_t)buffer[4 + i * 4] << 24);
+	s->device_hz = values[0];
+	s->device_rx_bytes = values[1];
+	s->device_rx_cycles = values[2];
+	s->device_wait_cycles = values[3];
+}
+
+/**************************************************************************************************
+* Address one node on the bus, the others ignore everything until the next selection or broadcast
+*/
+bool SelectNode(SESSION_t *s, const uint8_t *serial)
+{
+	char cmd[1 + NODE_SERIAL_LENGTH];
+	cmd[0] = CMD_SELECT_NODE;
+	memcpy(&cmd[1], serial, NODE_SERIAL_LENGTH);
+	sp_drain(s->port);
+	SleepMs(BUS_IDLE_MS);
+	return Command(s, cmd, sizeof(cmd));
+}
+
+/**************************************************************************************************
+* Send a command to every node, after putting them all back in broadcast mode. Nothing responds.
+*/
+bool BroadcastCommand(SESSION_t *s, char *cmd, int len)
+{
+	const uint8_t magic[BROADCAST_MAGIC_LENGTH] = BROADCAST_MAGIC;
+	char buffer[1 + BROADCAST_MAGIC_LENGTH + 16];
+	int total = 1 + BROADCAST_MAGIC_LENGTH + len;
+	if (len > 16)
+		return false;
+	buffer[0] = CMD_BROADCAST;
+	memcpy(&buffer[1], magic, BROADCAST_MAGIC_LENGTH);
+	memcpy(&buffer[1 + BROADCAST_MAGIC_LENGTH], cmd, len);
+	sp_drain(s->port);
+	SleepMs(BUS_IDLE_MS);
+	if (check(sp_blocking_write(s->port, buffer, total, WriteTimeout(s, total))) != total)
+		return false;
+	sp_drain(s->port);
+	return true;
+}
+
+/**************************************************************************************************
+* Send pages to every node with windowed frames. Nothing is acknowledged, pages that are missed
+* are found and rewritten when each node is polled.
+*/
+bool BroadcastPages(SESSION_t *s, int *pages, int count)
+{
+	int frame_len = 4 + fw_info->page_size_b + 2;
+	int gap = WindowGap(s, frame_len);
+	uint8_t *buffer = malloc(WINDOW_MAX_FRAMES * (frame_len + gap));
+	if (buffer == NULL)
+	{
+		SessionPrintf(s, "Out of memory.\n");
+		return false;
+	}
+
+	uint8_t seq = 0;
+	uint64_t start = TimeUs();
+	int64_t total = 0;
+	for (int first = 0; first < count; first += WINDOW_MAX_FRAMES)
+	{
+		SessionPrintf(s, "Page %d of %d (%d%%)\n", first, count, (first * 100) / count);
+		uint64_t chunk_start = TimeUs();
+		uint8_t *p = buffer;
+		int n = 0;
+		for (int i = first; (i < count) && (i < first + WINDOW_MAX_FRAMES); i++, n++)
+			p += BuildWindowedFrame(p, seq++, pages[i], gap);
+
+		int len = p - buffer;
+		if (check(sp_blocking_write(s->port, buffer, len, WriteTimeout(s, len))) != len)
+		{
+			SessionPrintf(s, "sp_blocking_write() failed when writing firmware image.\n");
+			free(buffer);
+			return false;
+		}
+		total += len;
+
+		uint64_t per_page = (TimeUs() - chunk_start) / n;
+		for (int i = 0; i < n; i++)
+			TimingPage(&s->timing, pages[first + i], chunk_start + i * per_page, chunk_start + (i + 1) * per_page);
+	}
+	sp_drain(s->port);
+	free(buffer);
+
+	// USB adapters return from a drain with data still in their FIFO, wait until it is on the wire
+	int32_t remaining = (int32_t)((total * 10000) / s->baud) - (int32_t)((TimeUs() - start) / 1000);
+	if (remaining > 0)
+		SleepMs(remaining);
+	return true;
+}
+
+/**************************************************************************************************
+* Update every node on an RS485 bus with one transfer of the image. All nodes are put in the
+* bootloader and muted, erased and written together, then each is polled for its CRC and any
+* pages it missed are rewritten individually.
+*/
+bool BroadcastUpdate(SESSION_t *s)
+{
+	int num_pages = fw_info->flash_size_b / fw_info->page_size_b;
+	bool result = false;
+	int *pages = malloc(num_pages * sizeof(int));
+	uint8_t *page_actions = malloc(num_pages);
+	if ((pages == NULL) || (page_actions == NULL))
+	{
+		SessionPrintf(s, "Out of memory.\n");
+		goto exit;
+	}
+
+	// nodes starting up enter the bootloader muted, nodes already in it are muted and deselected ones
+	// rejoin on the full preamble
+	TimingPhase(&s->timing, PHASE_DISCOVERY);
+	SessionPrintf(s, "Broadcasting to %d nodes...\n", num_nodes);
+	const uint8_t magic[BROADCAST_MAGIC_LENGTH] = BROADCAST_MAGIC;
+	uint8_t preamble[1 + BROADCAST_MAGIC_LENGTH];
+	preamble[0] = CMD_BROADCAST;
+	memcpy(&preamble[1], magic, BROADCAST_MAGIC_LENGTH);
+	for (int t = 0; t < BROADCAST_ENTRY_MS; t += 10)
+	{
+		sp_blocking_write(s->port, preamble, sizeof(preamble), WriteTimeout(s, sizeof(preamble)));
+		SleepMs(10);
+	}
+	sp_flush(s->port, SP_BUF_BOTH);
+
+	if ((opt_turnaround >= 0) && !SetTurnaround(s, opt_turnaround))
+		goto exit;
+
+	TimingPhase(&s->timing, PHASE_ERASE);
+	SessionPrintf(s, "Erasing application section...\n");
+	if (!BroadcastCommand(s, "!", 1))
+		goto exit;
+	SleepMs(APP_SECTION_ERASE_TIMEOUT_MS);
+
+	int count = 0;
+	for (int page = 0; page < num_pages; page++)
+	{
+		if (PagePopulated(page, fw_info->page_size_b))
+			pages[count++] = page;
+	}
+	TimingPhase(&s->timing, PHASE_WRITE);
+	SessionPrintf(s, "Writing firmware image...\n");
+	if (!BroadcastPages(s, pages, count))
+		goto exit;
+
+	// poll each node, repairing any that missed pages
+	TimingPhase(&s->timing, PHASE_VERIFY);
+	int updated = 0;
+	for (int i = 0; i < num_nodes; i++)
+	{
+		char hex[NODE_SERIAL_LENGTH * 2 + 1];
+		SessionPrintf(s, "Node %s\n", SerialToHex(nodes[i], hex));
+		if (!SelectNode(s, nodes[i]))
+		{
+			SessionPrintf(s, "Not responding.\n");
+			continue;
+		}
+		if (!VerifyFirmware(s))
+		{
+			memset(page_actions, 0, num_pages);
+			int changed = FindChangedPages(s, num_pages, page_actions);
+			if (changed < 0)
+				continue;
+			SessionPrintf(s, "Repairing %d pages...\n", changed);
+			if (!ApplyPageActions(s, page_actions, num_pages, changed) ||
+				!VerifyFirmware(s))
+				continue;
+		}
+		updated++;
+	}
+
+	// start the application on every node together
+	TimingPhase(&s->timing, PHASE_RESET);
+	BroadcastCommand(s, "#", 1);
+
+	SessionPrintf(s, "\n%d of %d nodes updated.\n", updated, num_nodes);
+	result = (updated == num_nodes);
+
+exit:
+	free(pages);
+	free(page_actions);
+	return result;
+}
+
+/**************************************************************************************************
+* Compare the application section CRC calculated by the NVM controller with the loaded image
+*/
+bool VerifyFirmware(SESSION_t *s)
+{
+	SessionPrintf(s, "Verifying...\n");
+
+	// completes any pipelined write first
+	if (!Command(s, "c", 1))
+		return false;
+
+	uint8_t crcs[8];
+	if (check(ReadResponse(s, crcs, sizeof(crcs), 0, 0)) != sizeof(crcs))
+	{
+		SessionPrintf(s, "sp_blocking_read() failed.\n");
+		return false;
+	}
+
+	uint32_t app_crc = crcs[0] | (crcs[1] << 8) | (crcs[2] << 16) | ((uint32_t)crcs[3] << 24);
+	if (app_crc != firmware_crc)
+	{
+		SessionPrintf(s, "CRC mismatch, device 0x%06X, image 0x%06X.\n", app_crc, firmware_crc);
+		return false;
+	}
+	SessionPrintf(s, "Device CRC:\t0x%06X\n", app_crc);
+	return true;
+}
+
+/**************************************************************************************************
+* Read the bootloader version, MCU ID, serial number, fuses and memory sizes in one round trip.
+* Returns false if the record is bad or missing. Bootloaders before version 7 ignore the command, so
+* it is only sent once the version is known.
+*/
+bool GetBootloaderInfo(SESSION_t *s)
+{
+	char cmd = CMD_READ_INFO;
+	uint8_t buffer[256 + 2];
+	if ((check(sp_flush(s->port, SP_BUF_BOTH)) != SP_OK) ||
+		(check(sp_blocking_write(s->port, &cmd, 1, WriteTimeout(s, 1))) != 1) ||
+		(check(ReadResponse(s, buffer, 3, 1, 0)) != 3) ||
+		(buffer[0] != RES_OK))
+		return false;
+
+	// later versions may append to the record
+	int len = buffer[1] | (buffer[2] << 8);
+	if ((len < BOOTLOADER_INFO_LENGTH) || (len > 256) ||
+		(check(ReadResponse(s, buffer, len + 2, 0, 0)) != len + 2) ||
+		(crc16_xmodem(0, buffer, len) != (buffer[len] | (buffer[len + 1] << 8))))
+	{
+		SessionPrintf(s, "Bad bootloader info response.\n");
+		return false;
+	}
+
+	DEVICE_INFO_t *info = &s->info;
+	s->version = buffer[INFO_VERSION];
+	memcpy(info->mcu_id, &buffer[INFO_MCU_ID], sizeof(info->mcu_id));
+	memcpy(info->serial, &buffer[INFO_SERIAL], sizeof(info->serial));
+	memcpy(info->fuses, &buffer[INFO_FUSES], sizeof(info->fuses));
+	uint32_t sizes[6];
+	for (int i = 0; i < 6; i++)
+	{
+		uint8_t *p = &buffer[INFO_MEMORY_SIZES + i * 4];
+		sizes[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	info->app_page_size = sizes[0];
+	info->app_size = sizes[1];
+	info->boot_page_size = sizes[2];
+	info->boot_size = sizes[3];
+	info->eeprom_page_size = sizes[4];
+	info->eeprom_size = sizes[5];
+	s->has_info = true;
+
+	SessionPrintf(s, "Bootloader:\tversion %d\n", s->version);
+	SessionPrintf(s, "MCU ID:\t\t%02X%02X%02X-%c\n", info->mcu_id[0], info->mcu_id[1], info->mcu_id[2], info->mcu_id[3] + 'A');
+	SessionPrintf(s, "MCU fuses:\t%02X %02X %02X %02X %02X %02X\n", info->fuses[0], info->fuses[1], info->fuses[2], info->fuses[3], info->fuses[4], info->fuses[5]);
+	return true;
+}
+
+/**************************************************************************************************
+* Check the loaded image was built for the device's memory layout, before anything is erased
+*/
+bool CheckDeviceInfo(SESSION_t *s)
+{
+	if ((s->info.app_size == fw_info->flash_size_b) && (s->info.app_page_size == fw_info->page_size_b) &&
+		(s->info.eeprom_size == fw_info->eeprom_size_b) && (s->info.eeprom_page_size == fw_info->eeprom_page_size_b))
+		return true;
+
+	SessionPrintf(s, "Firmware is for %u bytes of flash in %u byte pages, %u bytes of EEPROM in %u byte pages.\n",
+				  fw_info->flash_size_b, fw_info->page_size_b, fw_info->eeprom_size_b, fw_info->eeprom_page_size_b);
+	SessionPrintf(s, "Device has %u bytes of flash in %u byte pages, %u bytes of EEPROM in %u byte pages.\n",
+				  s->info.app_size, s->info.app_page_size, s->info.eeprom_size, s->info.eeprom_page_size);
+	return false;
+}
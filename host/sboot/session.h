@@ -0,0 +1,46 @@
+// session.h
+
+#ifndef __SESSION_H
+#define __SESSION_H
+
+#include "timing.h"
+#include "bootloader.h"
+
+
+// CMD_READ_INFO record
+typedef struct {
+	uint8_t			mcu_id[4];				// DEVID0-2, REVID
+	uint8_t			serial[NODE_SERIAL_LENGTH];
+	uint8_t			fuses[6];
+	uint32_t		app_page_size;
+	uint32_t		app_size;
+	uint32_t		boot_page_size;
+	uint32_t		boot_size;
+	uint32_t		eeprom_page_size;
+	uint32_t		eeprom_size;
+} DEVICE_INFO_t;
+
+// state for flashing one device, the loaded image is shared read-only between sessions
+typedef struct {
+	char			*port_name;
+	struct sp_port	*port;
+	int				baud;
+	int				version;				// bootloader version, read when it changes how data is sent
+	bool			has_info;				// version 7+ sent the device info
+	DEVICE_INFO_t	info;
+	uint8_t			*frame;					// -f and -z page frame
+	long			compressed_bytes;		// frame bytes sent with -z, and what they would have been with -f
+	long			uncompressed_bytes;
+	bool			ok;						// update completed and verified
+	TIMING_t		timing;
+	int64_t			srtt_us;				// smoothed response turnaround, excluding time on the wire
+	int64_t			rttvar_us;
+	int				rtt_samples;
+	uint32_t		device_hz;				// bootloader page reception cost, device_hz is 0 unless it reported it
+	uint32_t		device_rx_bytes;
+	uint32_t		device_rx_cycles;
+	uint32_t		device_wait_cycles;
+} SESSION_t;
+
+
+#endif
@@ -0,0 +1,216 @@
+// timing.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "timing.h"
+
+
+static const char *phase_names[NUM_PHASES] = {
+	"discovery", "baud", "erase", "compare", "write", "verify", "read", "reset"
+};
+
+
+/**************************************************************************************************
+* Monotonic clock in microseconds
+*/
+uint64_t TimeUs(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((now.QuadPart / freq.QuadPart) * 1000000 + ((now.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/**************************************************************************************************
+* Add a sample to a power of two histogram
+*/
+void HistogramAdd(HISTOGRAM_t *h, uint64_t us)
+{
+	if ((h->count == 0) || (us < h->min_us))
+		h->min_us = us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->count++;
+	h->total_us += us;
+
+	int bucket = 0;
+	while ((bucket < HISTOGRAM_BUCKETS - 1) && (us >= (1ULL << bucket)))
+		bucket++;
+	h->buckets[bucket]++;
+}
+
+/**************************************************************************************************
+* Session phases. Time between phases, e.g. opening the port, is not counted in any of them.
+*/
+void TimingStart(TIMING_t *t)
+{
+	memset(t, 0, sizeof(TIMING_t));
+	t->start_us = TimeUs();
+	t->phase = PHASE_NONE;
+}
+
+void TimingPhase(TIMING_t *t, PHASE_t phase)
+{
+	uint64_t now = TimeUs();
+	if (t->phase != PHASE_NONE)
+		t->phase_us[t->phase] += now - t->phase_start_us;
+	t->phase = phase;
+	t->phase_start_us = now;
+}
+
+void TimingEnd(TIMING_t *t)
+{
+	TimingPhase(t, PHASE_NONE);
+	t->end_us = t->phase_start_us;
+}
+
+/**************************************************************************************************
+* Log one page write, pages that are resent appear more than once
+*/
+void TimingPage(TIMING_t *t, int page, uint64_t start_us, uint64_t end_us)
+{
+	HistogramAdd(&t->page_write, end_us - start_us);
+
+	if (t->num_pages >= t->max_pages)
+	{
+		int max_pages = t->max_pages ? t->max_pages * 2 : 256;
+		PAGE_TIMING_t *pages = realloc(t->pages, max_pages * sizeof(PAGE_TIMING_t));
+		if (pages == NULL)
+			return;			// histogram is still complete
+		t->pages = pages;
+		t->max_pages = max_pages;
+	}
+	t->pages[t->num_pages].page = page;
+	t->pages[t->num_pages].start_us = start_us - t->start_us;
+	t->pages[t->num_pages].duration_us = end_us - start_us;
+	t->num_pages++;
+}
+
+void TimingFree(TIMING_t *t)
+{
+	free(t->pages);
+	t->pages = NULL;
+	t->num_pages = t->max_pages = 0;
+}
+
+/**************************************************************************************************
+* Human readable summary
+*/
+static void PrintHistogram(const HISTOGRAM_t *h, const char *prefix, const char *name)
+{
+	if (h->count == 0)
+		return;
+	printf("%s%s: %lu, min %.2f ms, mean %.2f ms, max %.2f ms\n", prefix, name, h->count,
+		   h->min_us / 1000.0, (h->total_us / h->count) / 1000.0, h->max_us / 1000.0);
+
+	unsigned long peak = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (h->buckets[i] > peak)
+			peak = h->buckets[i];
+	}
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (h->buckets[i] == 0)
+			continue;
+		char bar[41];
+		int len = (int)((h->buckets[i] * 40 + peak - 1) / peak);
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		if (i == HISTOGRAM_BUCKETS - 1)
+			printf("%s  >= %8.2f ms %6lu %s\n", prefix, (1ULL << (i - 1)) / 1000.0, h->buckets[i], bar);
+		else
+			printf("%s  <  %8.2f ms %6lu %s\n", prefix, (1ULL << i) / 1000.0, h->buckets[i], bar);
+	}
+}
+
+void TimingPrint(const TIMING_t *t, const char *prefix)
+{
+	uint64_t total = t->end_us - t->start_us;
+	printf("%sTotal:\t\t%.3f s\n", prefix, total / 1000000.0);
+	for (int i = 0; i < NUM_PHASES; i++)
+	{
+		if (t->phase_us[i] == 0)
+			continue;
+		printf("%s  %-10s\t%.3f s (%d%%)\n", prefix, phase_names[i], t->phase_us[i] / 1000000.0,
+			   total ? (int)((t->phase_us[i] * 100) / total) : 0);
+	}
+	if (t->resends)
+		printf("%sResends:\t%lu\n", prefix, t->resends);
+	PrintHistogram(&t->page_write, prefix, "Page writes");
+	PrintHistogram(&t->ack_wait, prefix, "Response waits");
+}
+
+/**************************************************************************************************
+* JSON summary, times are in microseconds
+*/
+void JsonString(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s != '\0'; s++)
+	{
+		if ((*s == '"') || (*s == '\\'))
+			fputc('\\', fp);
+		if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void JsonHistogram(FILE *fp, const HISTOGRAM_t *h)
+{
+	fprintf(fp, "{ \"count\": %lu, \"min_us\": %llu, \"mean_us\": %llu, \"max_us\": %llu, \"buckets\": [",
+			h->count, (unsigned long long)h->min_us,
+			(unsigned long long)(h->count ? h->total_us / h->count : 0), (unsigned long long)h->max_us);
+	bool first = true;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (h->buckets[i] == 0)
+			continue;
+		// "lt_us" is the exclusive upper bound, null for the overflow bucket
+		if (i == HISTOGRAM_BUCKETS - 1)
+			fprintf(fp, "%s{ \"lt_us\": null, \"count\": %lu }", first ? " " : ", ", h->buckets[i]);
+		else
+			fprintf(fp, "%s{ \"lt_us\": %llu, \"count\": %lu }", first ? " " : ", ", 1ULL << i, h->buckets[i]);
+		first = false;
+	}
+	fprintf(fp, first ? "] }" : " ] }");
+}
+
+void TimingWriteJson(FILE *fp, const TIMING_t *t, const char *indent)
+{
+	fprintf(fp, "%s\"total_us\": %llu,\n", indent, (unsigned long long)(t->end_us - t->start_us));
+	fprintf(fp, "%s\"phases_us\": {", indent);
+	for (int i = 0; i < NUM_PHASES; i++)
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : " ", phase_names[i], (unsigned long long)t->phase_us[i]);
+	fprintf(fp, " },\n");
+	fprintf(fp, "%s\"resends\": %lu,\n", indent, t->resends);
+	fprintf(fp, "%s\"page_write\": ", indent);
+	JsonHistogram(fp, &t->page_write);
+	fprintf(fp, ",\n%s\"ack_wait\": ", indent);
+	JsonHistogram(fp, &t->ack_wait);
+	fprintf(fp, ",\n%s\"pages\": [", indent);
+	for (int i = 0; i < t->num_pages; i++)
+	{
+		fprintf(fp, "%s\n%s\t{ \"page\": %d, \"start_us\": %llu, \"duration_us\": %llu }", i ? "," : "", indent,
+				t->pages[i].page, (unsigned long long)t->pages[i].start_us, (unsigned long long)t->pages[i].duration_us);
+	}
+	fprintf(fp, t->num_pages ? "\n%s]\n" : "]\n", indent);
+}
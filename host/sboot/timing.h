@@ -0,0 +1,67 @@
+// timing.h
+
+#ifndef __TIMING_H
+#define __TIMING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define	HISTOGRAM_BUCKETS		24		// bucket n counts samples under 2^n us, the last one everything above
+
+typedef enum {
+	PHASE_DISCOVERY,		// waiting for the bootloader, or putting every node into it with -m
+	PHASE_BAUD,
+	PHASE_ERASE,
+	PHASE_COMPARE,			// -d page CRCs
+	PHASE_WRITE,			// page erases and writes
+	PHASE_VERIFY,			// with -m, polling and repairing each node
+	PHASE_READ,				// --dump
+	PHASE_RESET,
+	NUM_PHASES,
+	PHASE_NONE = -1
+} PHASE_t;
+
+typedef struct {
+	unsigned long	count;
+	uint64_t		total_us;
+	uint64_t		min_us;
+	uint64_t		max_us;
+	unsigned long	buckets[HISTOGRAM_BUCKETS];
+} HISTOGRAM_t;
+
+typedef struct {
+	int				page;
+	uint64_t		start_us;		// since the session started
+	uint64_t		duration_us;	// with -w, the window round trip shared between its pages
+} PAGE_TIMING_t;
+
+typedef struct {
+	uint64_t		start_us;
+	uint64_t		end_us;
+	PHASE_t			phase;
+	uint64_t		phase_start_us;
+	uint64_t		phase_us[NUM_PHASES];
+	HISTOGRAM_t		page_write;		// per page write, erase included with -d
+	HISTOGRAM_t		ack_wait;		// from the end of a write to the response arriving
+	unsigned long	resends;
+	PAGE_TIMING_t	*pages;
+	int				num_pages;
+	int				max_pages;
+} TIMING_t;
+
+
+extern uint64_t TimeUs(void);
+extern void HistogramAdd(HISTOGRAM_t *h, uint64_t us);
+extern void TimingStart(TIMING_t *t);
+extern void TimingPhase(TIMING_t *t, PHASE_t phase);
+extern void TimingEnd(TIMING_t *t);
+extern void TimingPage(TIMING_t *t, int page, uint64_t start_us, uint64_t end_us);
+extern void TimingFree(TIMING_t *t);
+extern void TimingPrint(const TIMING_t *t, const char *prefix);
+extern void TimingWriteJson(FILE *fp, const TIMING_t *t, const char *indent);
+extern void JsonString(FILE *fp, const char *s);
+
+
+#endif